@@ -0,0 +1,219 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defn.h"
+
+// Constants
+#define CHUNK_SIZE 65536
+#define ALIGNMENT 16
+
+// One block of arena memory, chunks are kept across resets and reused
+struct chunk {
+  struct chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+// Prototypes
+static struct chunk *new_chunk(size_t size);
+
+// Global Variables
+static struct chunk *arena_head; // First chunk, where every line starts
+static struct chunk *arena_cur; // Chunk currently being bumped
+static void *arena_last; // Most recent allocation, may be grown in place
+static size_t arena_in_use; // Bytes handed out since the last reset
+static size_t arena_high_water; // Largest arena_in_use ever seen
+
+void *arena_alloc(size_t size) {
+  // Round up so every allocation stays aligned
+  size = (size + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+  if (arena_cur == NULL) {
+    if ((arena_head = new_chunk(size)) == NULL) {
+      return NULL;
+    }
+    arena_cur = arena_head;
+  }
+  // Move on to the next chunk if this one is full
+  while (arena_cur->size - arena_cur->used < size) {
+    arena_in_use += arena_cur->size - arena_cur->used;
+    struct chunk *next = arena_cur->next;
+    if (next == NULL || next->size < size) {
+      // Insert a bigger chunk here, the arena doubles each time it grows
+      size_t chunk_size = arena_cur->size * 2;
+      if ((next = new_chunk(size > chunk_size ? size : chunk_size)) == NULL) {
+        return NULL;
+      }
+      next->next = arena_cur->next;
+      arena_cur->next = next;
+    }
+    arena_cur = next;
+    arena_cur->used = 0;
+  }
+  // Bump
+  arena_last = &arena_cur->data[arena_cur->used];
+  arena_cur->used += size;
+  arena_in_use += size;
+  if (arena_in_use > arena_high_water) {
+    arena_high_water = arena_in_use;
+  }
+  return arena_last;
+}
+
+void *arena_grow(void *ptr, size_t oldsize, size_t newsize) {
+  oldsize = (oldsize + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+  newsize = (newsize + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+  // Extend in place if ptr is the top of the current chunk
+  if (ptr != NULL && ptr == arena_last &&
+      arena_cur->size - arena_cur->used >= newsize - oldsize) {
+    arena_cur->used += newsize - oldsize;
+    arena_in_use += newsize - oldsize;
+    if (arena_in_use > arena_high_water) {
+      arena_high_water = arena_in_use;
+    }
+    return ptr;
+  }
+  // Otherwise copy it somewhere bigger, the old space is reclaimed on reset
+  void *new = arena_alloc(newsize);
+  if (new != NULL && ptr != NULL) {
+    memcpy(new, ptr, oldsize);
+  }
+  return new;
+}
+
+void arena_reset(void) {
+  // Later chunks are marked empty as they get reused
+  if (arena_head != NULL) {
+    arena_head->used = 0;
+  }
+  arena_cur = arena_head;
+  arena_last = NULL;
+  arena_in_use = 0;
+}
+
+/*
+ * arena_release() frees everything allocated since arena_mark(), for a
+ * builtin like parallel that runs many lines within one and would otherwise
+ * hold on to all of them until its own line ends.
+ */
+void arena_mark(struct arena_mark *mark) {
+  mark->chunk = arena_cur;
+  mark->used = arena_cur != NULL ? arena_cur->used : 0;
+  mark->in_use = arena_in_use;
+}
+
+void arena_release(struct arena_mark *mark) {
+  if (mark->chunk == NULL) {
+    arena_reset();
+    return;
+  }
+  // Chunks after it are marked empty as they get reused, as after a reset
+  arena_cur = mark->chunk;
+  arena_cur->used = mark->used;
+  arena_last = NULL;
+  arena_in_use = mark->in_use;
+}
+
+void arena_stats(size_t *capacity, int *chunks, size_t *high_water) {
+  *capacity = 0;
+  *chunks = 0;
+  for (struct chunk *chunk = arena_head; chunk != NULL; chunk = chunk->next) {
+    *capacity += chunk->size;
+    (*chunks)++;
+  }
+  *high_water = arena_high_water;
+}
+
+static struct chunk *new_chunk(size_t size) {
+  if (size < CHUNK_SIZE) {
+    size = CHUNK_SIZE;
+  }
+  struct chunk *chunk = malloc(sizeof(struct chunk) + size);
+  if (chunk == NULL) {
+    fprintf(stderr, "Malloc of line arena failed.\n");
+    return NULL;
+  }
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+int buffer_init(struct buffer *buf, size_t size) {
+  buf->len = 0;
+  buf->size = size;
+  buf->data = arena_alloc(size);
+  if (buf->data == NULL) {
+    buf->size = 0;
+    return 0;
+  }
+  buf->data[0] = 0;
+  return 1;
+}
+
+int buffer_reserve(struct buffer *buf, size_t extra) {
+  // Always leave room for a terminating 0
+  if (buf->len + extra < buf->size) {
+    return 1;
+  }
+  size_t size = buf->size * 2;
+  if (size <= buf->len + extra) {
+    size = buf->len + extra + 1;
+  }
+  char *data = arena_grow(buf->data, buf->size, size);
+  if (data == NULL) {
+    return 0;
+  }
+  buf->data = data;
+  buf->size = size;
+  return 1;
+}
+
+int buffer_append(struct buffer *buf, const char *str, size_t len) {
+  if (!buffer_reserve(buf, len)) {
+    return 0;
+  }
+  memcpy(&buf->data[buf->len], str, len);
+  buf->len += len;
+  buf->data[buf->len] = 0;
+  return 1;
+}
+
+int buffer_printf(struct buffer *buf, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int ok = buffer_vprintf(buf, format, args);
+  va_end(args);
+  return ok;
+}
+
+int buffer_vprintf(struct buffer *buf, const char *format, va_list args) {
+  va_list again;
+  // Try to fit it in the space left first
+  va_copy(again, args);
+  int chars = vsnprintf(&buf->data[buf->len], buf->size - buf->len, format,
+                        args);
+  if (chars < 0) {
+    va_end(again);
+    return 0;
+  }
+  if ((size_t) chars >= buf->size - buf->len) {
+    // Didn't fit, make room and format it again
+    if (!buffer_reserve(buf, chars)) {
+      va_end(again);
+      return 0;
+    }
+    vsnprintf(&buf->data[buf->len], buf->size - buf->len, format, again);
+  }
+  va_end(again);
+  buf->len += chars;
+  return 1;
+}
@@ -0,0 +1,222 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defn.h"
+
+/*
+ * batch [-j N] [-n N] CMD [ARG...] [::: ITEM...]
+ *
+ * Runs CMD with the items split over as many commands as it takes to keep
+ * each one under the kernel's argument size limit (ARG_MAX, less what the
+ * environment uses), so "batch rm *.log" works however many files match.
+ * Without :::, every word after CMD is an item. -n caps the items per
+ * command, -j runs up to N commands at once instead of one after another.
+ *
+ * The exit value is 0 if every command succeeded, 123 if any failed, 127
+ * if CMD couldn't be found (nothing more is started then), or 130 after ^C.
+ */
+
+// Constants
+#define ARG_HEADROOM 2048 // Room left for the exec'd program, as xargs does
+#define MAX_ARG_STRLEN 131072 // Longest single argument Linux will take
+#define BATCH_FAILED 123
+#define BATCH_NOT_FOUND 127
+
+extern char **environ;
+
+struct chunk {
+  char **argv;
+  int job;
+};
+
+// Prototypes
+static long arg_limit(void);
+static int next_chunk(char **fixed, int nfixed, char **items, int nitems,
+                      int *next, long limit, int per_chunk, char ***argvptr);
+static int finish_chunk(struct chunk *chunk);
+
+void batch(char **argpointers, int argc) {
+  int njobs = 1;
+  int per_chunk = 0;
+  int i;
+  // Parse options
+  for (i = 1; i < argc && argpointers[i][0] == '-'; i++) {
+    if (!strcmp(argpointers[i], "-j") && i + 1 < argc) {
+      njobs = atoi(argpointers[++i]);
+    } else if (!strcmp(argpointers[i], "-n") && i + 1 < argc) {
+      per_chunk = atoi(argpointers[++i]);
+    } else {
+      break;
+    }
+  }
+  // The command runs up to ::: if there is one, or is just its first word
+  char **fixed = &argpointers[i];
+  int nfixed = 0;
+  while (i + nfixed < argc && strcmp(argpointers[i + nfixed], ":::")) {
+    nfixed++;
+  }
+  char **items;
+  int nitems;
+  if (i + nfixed < argc) {
+    items = &argpointers[i + nfixed + 1];
+    nitems = argc - i - nfixed - 1;
+  } else {
+    nfixed = nfixed > 0;
+    items = &argpointers[i + nfixed];
+    nitems = argc - i - nfixed;
+  }
+  if (nfixed == 0 || njobs < 1 || per_chunk < 0) {
+    fprintf(stderr, "Usage: batch [-j N] [-n N] CMD [ARG...] [::: ITEM...]\n");
+    last_exit = 1;
+    return;
+  }
+  long limit = arg_limit();
+  for (int k = 0; k < nfixed; k++) {
+    limit -= strlen(fixed[k]) + 1 + sizeof(char *);
+  }
+  struct chunk *running = calloc(njobs, sizeof(struct chunk));
+  int *jobs = malloc(sizeof(int) * njobs);
+  if (running == NULL || jobs == NULL) {
+    fprintf(stderr, "Malloc of batch failed.\n");
+    free(running);
+    free(jobs);
+    last_exit = 1;
+    return;
+  }
+  int next = 0; // Next item to hand out
+  int nrunning = 0;
+  int failures = 0;
+  int notfound = 0;
+  int started = 0;
+  while (1) {
+    // Keep njobs commands in flight, always run at least one
+    while (!notfound && !sigint_caught && nrunning < njobs &&
+           (next < nitems || started == 0)) {
+      char **argv;
+      int got = next_chunk(fixed, nfixed, items, nitems, &next, limit,
+                           per_chunk, &argv);
+      started++;
+      if (got < 0) {
+        failures++;
+        continue;
+      }
+      struct pipeline pl;
+      struct stage stage = {argv, nfixed + got};
+      pl.stages = &stage;
+      pl.nstages = 1;
+      pl.background = 0;
+      // Already expanded once on the way into batch
+      int job = run_pipeline(&pl, builtin_infd, builtin_outfd, NOWAIT);
+      if (job <= 0) {
+        // A builtin ran, it couldn't be run, or it failed to start
+        if (job < 0 || last_exit != 0) {
+          failures++;
+        }
+        notfound = job == 0 && last_exit == BATCH_NOT_FOUND;
+        free(argv);
+        continue;
+      }
+      running[nrunning].argv = argv;
+      running[nrunning].job = job - 1;
+      nrunning++;
+    }
+    if (nrunning == 0) {
+      break;
+    }
+    // Sleep until any command finishes
+    for (int k = 0; k < nrunning; k++) {
+      jobs[k] = running[k].job;
+    }
+    int done = job_wait_any(jobs, nrunning);
+    if (done < 0) {
+      // ^C, let the ones running finish dying
+      for (int k = 0; k < nrunning; k++) {
+        failures += finish_chunk(&running[k]);
+      }
+      nrunning = 0;
+      continue;
+    }
+    failures += finish_chunk(&running[done]);
+    running[done] = running[--nrunning];
+  }
+  free(running);
+  free(jobs);
+  last_exit = sigint_caught ? 130 : notfound ? BATCH_NOT_FOUND :
+              failures ? BATCH_FAILED : 0;
+}
+
+static long arg_limit(void) {
+  long limit = sysconf(_SC_ARG_MAX);
+  if (limit <= 0) {
+    limit = MAX_ARG_STRLEN;
+  }
+  // The environment comes out of the same space
+  for (char **env = environ; *env != NULL; env++) {
+    limit -= strlen(*env) + 1 + sizeof(char *);
+  }
+  return limit - ARG_HEADROOM;
+}
+
+/*
+ * Take as many items from *next on as fit in limit bytes (and per_chunk
+ * items, if it isn't 0) and put them after the fixed words in a new malloced
+ * argv. Returns the number of items taken, or -1 if the next item can't be
+ * passed to any command, which is skipped.
+ */
+static int next_chunk(char **fixed, int nfixed, char **items, int nitems,
+                      int *next, long limit, int per_chunk, char ***argvptr) {
+  int first = *next;
+  int count = 0;
+  long used = 0;
+  while (first + count < nitems && (per_chunk == 0 || count < per_chunk)) {
+    size_t len = strlen(items[first + count]) + 1;
+    long cost = len + sizeof(char *);
+    if (used + cost > limit) {
+      break;
+    }
+    if (len > MAX_ARG_STRLEN) {
+      break;
+    }
+    used += cost;
+    count++;
+  }
+  if (count == 0 && first < nitems) {
+    // Too big for a command even on its own
+    fprintf(stderr, "batch: argument %d is too long to pass to %s\n",
+            first + 1, fixed[0]);
+    (*next)++;
+    return -1;
+  }
+  char **argv = malloc(sizeof(char *) * (nfixed + count + 1));
+  if (argv == NULL) {
+    fprintf(stderr, "Malloc of batch arguments failed.\n");
+    *next = nitems;
+    return -1;
+  }
+  memcpy(argv, fixed, sizeof(char *) * nfixed);
+  memcpy(&argv[nfixed], &items[first], sizeof(char *) * count);
+  argv[nfixed + count] = NULL;
+  *next = first + count;
+  *argvptr = argv;
+  return count;
+}
+
+// Wait for a command, returns 1 if it failed
+static int finish_chunk(struct chunk *chunk) {
+  int status;
+  int failed = 0;
+  if (job_wait(chunk->job, &status) > 0) {
+    failed = report_status(status, builtin_outfd) != 0;
+  }
+  job_free(chunk->job);
+  free(chunk->argv);
+  return failed;
+}
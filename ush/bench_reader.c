@@ -0,0 +1,100 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defn.h"
+
+/*
+ * Compares lines per second of the old fgets loop in main() against the
+ * script reader, both on a mapped file and on a pipe.
+ *
+ * Usage: bench_reader [LINES]
+ */
+
+// Constants
+#define LINELEN 200000
+#define DEFAULT_LINES 1000000
+
+// Prototypes
+double now(void);
+void report(const char *name, long lines, double secs);
+
+int main(int argc, char **argv) {
+  long nlines = argc > 1 ? atol(argv[1]) : DEFAULT_LINES;
+  char path[] = "/tmp/bench_readerXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  // Generate a machine-made script
+  FILE *out = fdopen(fd, "w");
+  for (long i = 0; i < nlines; i++) {
+    fprintf(out, "echo line %ld ${HOME} $(date +%%s) | grep -v x # c\n", i);
+  }
+  fclose(out);
+  // Old loop: fgets into a fixed buffer, strlen to find the newline
+  static char buffer[LINELEN];
+  FILE *in = fopen(path, "r");
+  long count = 0;
+  double start = now();
+  while (fgets(buffer, LINELEN, in) == buffer) {
+    int len = strlen(buffer);
+    if (buffer[len - 1] == '\n') {
+      buffer[len - 1] = 0;
+    }
+    count++;
+  }
+  report("fgets", count, now() - start);
+  fclose(in);
+  // Reader on the mapped file
+  struct reader rd;
+  size_t len;
+  fd = open(path, O_RDONLY);
+  count = 0;
+  start = now();
+  reader_open(&rd, fd);
+  while (reader_next(&rd, &len) != NULL) {
+    count++;
+    arena_reset();
+  }
+  reader_close(&rd);
+  report("reader_mmap", count, now() - start);
+  close(fd);
+  // Reader on a pipe, the path taken for stdin
+  char command[64];
+  snprintf(command, sizeof(command), "cat %s", path);
+  in = popen(command, "r");
+  count = 0;
+  start = now();
+  reader_open(&rd, fileno(in));
+  while (reader_next(&rd, &len) != NULL) {
+    count++;
+    arena_reset();
+  }
+  reader_close(&rd);
+  report("reader_pipe", count, now() - start);
+  pclose(in);
+  unlink(path);
+  return 0;
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, long lines, double secs) {
+  printf("%-12s %10ld lines %8.3f s %12.0f lines/s\n", name, lines, secs,
+         lines / secs);
+}
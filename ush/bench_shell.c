@@ -0,0 +1,183 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defn.h"
+
+/*
+ * Microbenchmarks for the shell's hot paths, each measured on its own:
+ * lex_compile() and expand() on a line full of expansion sites, lex_split()
+ * on a wide argument list and find_builtin() lookups, then whole lines per
+ * second through processline() for a builtin, an external command and a
+ * five stage pipeline. Every benchmark doubles its iteration count until a
+ * run takes at least SECONDS, and the results are printed as one JSON
+ * object so they can be kept and compared between builds.
+ *
+ * Usage: bench_shell [SECONDS]
+ *
+ * Run it from the source directory (make bench does), the '*' in the
+ * expand line globs the current directory.
+ */
+
+// Constants
+#define DEFAULT_SECONDS 0.5
+#define WIDE_ARGS 2048
+
+// Prototypes
+double now(void);
+void measure(const char *name, const char *unit, void (*function)(long),
+             double min_seconds);
+void bench_lex_compile(long n);
+void bench_expand(long n);
+void bench_lex_split(long n);
+void bench_find_builtin(long n);
+void bench_builtin_line(long n);
+void bench_external_line(long n);
+void bench_pipeline_line(long n);
+void run_line(const char *line, long n);
+
+// Global Variables
+static char *expand_line;
+static char *wide_line;
+static char *wide_copy;
+static size_t wide_len;
+static int devnull;
+static int nresults;
+
+static char *lookups[] = {"cd", "exit", "envset", "shift", "ls", "parallel",
+                          "arenastat", "grep", "wait", "jobs", "cat", "hash"};
+
+int main(int argc, char **argv) {
+  double min_seconds = argc > 1 ? atof(argv[1]) : DEFAULT_SECONDS;
+  // Positional arguments for $N and $#, as if running a script
+  static char *args[] = {"ush", "bench.ush", "alpha", "beta", "gamma"};
+  mainargc = 5;
+  mainargv = args;
+  setenv("USH_BENCH", "a value of moderate length", 1);
+  expand_line = strdup("echo $1 ${HOME} $# $2 ${USH_BENCH} * $3 ${PATH} "
+                       "$$ \\* ${USH_BENCH_MISSING} \"$1 ${HOME}\" *.c $2");
+  // Wide line: plain words with a quoted one every eighth
+  struct buffer wide;
+  if (!buffer_init(&wide, WIDE_ARGS * 8)) {
+    return 1;
+  }
+  buffer_printf(&wide, "cmd");
+  for (int i = 0; i < WIDE_ARGS; i++) {
+    buffer_printf(&wide, i % 8 ? " arg%d" : " \"quoted %d\"", i);
+  }
+  wide_len = wide.len;
+  wide_line = strdup(wide.data);
+  // Room past the end for the lexer's vector loads
+  wide_copy = malloc(wide_len + 64);
+  arena_reset();
+  if ((devnull = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+    perror("open");
+    return 1;
+  }
+  printf("{\"seconds\":%g,\"benchmarks\":[", min_seconds);
+  measure("lex_compile", "lines", bench_lex_compile, min_seconds);
+  measure("expand", "lines", bench_expand, min_seconds);
+  measure("lex_split_wide", "lines", bench_lex_split, min_seconds);
+  measure("find_builtin", "lookups", bench_find_builtin, min_seconds);
+  measure("line_builtin", "commands", bench_builtin_line, min_seconds);
+  measure("line_external", "commands", bench_external_line, min_seconds);
+  measure("line_pipeline5", "commands", bench_pipeline_line, min_seconds);
+  printf("\n]}\n");
+  close(devnull);
+  return 0;
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void measure(const char *name, const char *unit, void (*function)(long),
+             double min_seconds) {
+  long n = 1;
+  double secs;
+  // Double the count until a run is long enough to trust
+  while (1) {
+    double start = now();
+    function(n);
+    secs = now() - start;
+    if (secs >= min_seconds) {
+      break;
+    }
+    n *= 2;
+  }
+  printf("%s\n{\"name\":\"%s\",\"unit\":\"%s\",\"iterations\":%ld,"
+         "\"seconds\":%.6f,\"per_second\":%.1f,\"ns_per_op\":%.1f}",
+         nresults++ ? "," : "", name, unit, n, secs, n / secs, secs * 1e9 / n);
+  fflush(stdout);
+}
+
+void bench_lex_compile(long n) {
+  struct lineir ir;
+  for (long i = 0; i < n; i++) {
+    lex_compile(expand_line, &ir);
+    arena_reset();
+  }
+}
+
+void bench_expand(long n) {
+  struct lineir ir;
+  struct buffer out;
+  // Compiled each time, the sites live in the arena like the line does
+  for (long i = 0; i < n; i++) {
+    lex_compile(expand_line, &ir);
+    expand(expand_line, &ir, &out);
+    arena_reset();
+  }
+}
+
+void bench_lex_split(long n) {
+  struct pipeline pl;
+  // lex_split() cuts the line up in place, so give it a fresh copy each time
+  for (long i = 0; i < n; i++) {
+    memcpy(wide_copy, wide_line, wide_len + 1);
+    lex_split(wide_copy, &pl);
+    arena_reset();
+  }
+}
+
+void bench_find_builtin(long n) {
+  int nlookups = sizeof(lookups) / sizeof(lookups[0]);
+  volatile int found = 0;
+  for (long i = 0; i < n; i++) {
+    found += find_builtin(lookups[i % nlookups]) != NULL;
+  }
+}
+
+void bench_builtin_line(long n) {
+  run_line("envset USH_BENCH_SET value", n);
+}
+
+void bench_external_line(long n) {
+  run_line("/bin/true", n);
+}
+
+void bench_pipeline_line(long n) {
+  // Five processes, cat alone would be a builtin
+  run_line("seq 3 | /bin/cat | /bin/cat | /bin/cat | /bin/cat", n);
+}
+
+void run_line(const char *line, long n) {
+  char buffer[128];
+  // processline() strips comments in place, keep the original intact
+  for (long i = 0; i < n; i++) {
+    strcpy(buffer, line);
+    processline(buffer, 0, devnull, WAIT | EXPAND);
+    arena_reset();
+  }
+}
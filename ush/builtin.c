@@ -4,8 +4,13 @@
  * Spring Quarter 2020
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,38 +29,374 @@ void cd(char **argpointers, int argc);
 void shift(char **argpointers, int argc);
 void unshift(char **argpointers, int argc);
 void sstat(char **argpointers, int argc);
+void hash(char **argpointers, int argc);
+void arenastat(char **argpointers, int argc);
+void jobs(char **argpointers, int argc);
+void wait_jobs(char **argpointers, int argc);
+void echo(char **argpointers, int argc);
+void print_format(char **argpointers, int argc);
+void pwd(char **argpointers, int argc);
+void set_options(char **argpointers, int argc);
+void true_builtin(char **argpointers, int argc);
+void false_builtin(char **argpointers, int argc);
+void test(char **argpointers, int argc);
+static int echo_handles(char **argpointers, int argc);
+static int pwd_handles(char **argpointers, int argc);
+static int write_all(int fd, const char *data, size_t len);
+static void capture_newlines(size_t start);
+static int echo_escapes(const char *arg, struct buffer *out);
+static char *logical_pwd(void);
+static const char *format_escape(const char *p, struct buffer *out);
+static int format_conversion(const char **format, char *arg,
+                             struct buffer *out);
+static int test_or(char **args, int *pos, int end);
+static int test_and(char **args, int *pos, int end);
+static int test_not(char **args, int *pos, int end);
+static int test_primary(char **args, int *pos, int end);
+static int test_operator(const char *op);
+static int test_unary(const char *op, const char *arg);
+static int test_binary(const char *left, int op, const char *right);
+static int test_integer(const char *arg, long *value);
 
-// Global Variables
-int builtin_outfd;
+// Indexes into builtins[], keep in sync with find_builtin()
+enum {
+  BI_EXIT,
+  BI_ENVSET,
+  BI_ENVUNSET,
+  BI_CD,
+  BI_SHIFT,
+  BI_UNSHIFT,
+  BI_SSTAT,
+  BI_HASH,
+  BI_ARENASTAT,
+  BI_JOBS,
+  BI_WAIT,
+  BI_PARALLEL,
+  BI_ECHO,
+  BI_PRINTF,
+  BI_PWD,
+  BI_MEMO,
+  BI_DIRCACHE,
+  BI_BATCH,
+  BI_SET,
+  BI_CAT,
+  BI_CP,
+  BI_TRUE,
+  BI_FALSE,
+  BI_TEST,
+  BI_BRACKET,
+  NUM_BUILTINS
+};
+
+// Longest builtin name, anything longer can't be a builtin
+#define MAX_BUILTIN_LEN 9
+
+// Most output held back for the shell's stdout, see builtin_hold_init()
+#define HOLD_SIZE 65536
 
-// Used for clean function redirection
-typedef void (*funcptr)(char **, int argc);
-struct builtin {
-  char *name;
-  funcptr function;
+// Binary operators of test, indexes into test_binaries[]
+enum {
+  TEST_SAME,
+  TEST_SAME2,
+  TEST_DIFFERENT,
+  TEST_EQ,
+  TEST_NE,
+  TEST_LT,
+  TEST_LE,
+  TEST_GT,
+  TEST_GE,
+  TEST_NEWER,
+  TEST_OLDER,
+  TEST_SAME_FILE,
+  NUM_TEST_BINARIES
 };
+static const char *test_binaries[NUM_TEST_BINARIES] = {
+  [TEST_SAME] = "=",
+  [TEST_SAME2] = "==",
+  [TEST_DIFFERENT] = "!=",
+  [TEST_EQ] = "-eq",
+  [TEST_NE] = "-ne",
+  [TEST_LT] = "-lt",
+  [TEST_LE] = "-le",
+  [TEST_GT] = "-gt",
+  [TEST_GE] = "-ge",
+  [TEST_NEWER] = "-nt",
+  [TEST_OLDER] = "-ot",
+  [TEST_SAME_FILE] = "-ef"
+};
+
+// Global Variables
+static char held[HOLD_SIZE];
+static size_t heldlen;
+static int holdfd = -1; // Where held output goes, -1 if nothing may be held
+static int holding; // "Boolean" representing if the running builtin may hold
 
 // List of builtins
-static struct builtin builtins[] = {{"exit", exit_shell},
-                                    {"envset", envset},
-                                    {"envunset", envunset},
-                                    {"cd", cd},
-                                    {"shift", shift},
-                                    {"unshift", unshift},
-                                    {"sstat", sstat}};
-
-int check_for_builtin(char **argpointers, int argc, int outfd) {
+static struct builtin builtins[NUM_BUILTINS] = {
+  [BI_EXIT] = {"exit", exit_shell, BUILTIN_ENV | BUILTIN_CAPTURE},
+  [BI_ENVSET] = {"envset", envset, BUILTIN_ENV | BUILTIN_PIPESAFE |
+                 BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_ENVUNSET] = {"envunset", envunset, BUILTIN_ENV | BUILTIN_PIPESAFE |
+                   BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_CD] = {"cd", cd, BUILTIN_ENV | BUILTIN_PIPESAFE | BUILTIN_CAPTURE |
+             BUILTIN_BUFFERED},
+  [BI_SHIFT] = {"shift", shift, BUILTIN_ENV | BUILTIN_PIPESAFE |
+                BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_UNSHIFT] = {"unshift", unshift, BUILTIN_ENV | BUILTIN_PIPESAFE |
+                  BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_SSTAT] = {"sstat", sstat,
+                BUILTIN_OUTPUT | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_HASH] = {"hash", hash, BUILTIN_ENV},
+  [BI_ARENASTAT] = {"arenastat", arenastat,
+                    BUILTIN_OUTPUT | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_JOBS] = {"jobs", jobs, BUILTIN_ENV},
+  [BI_WAIT] = {"wait", wait_jobs, BUILTIN_ENV | BUILTIN_CAPTURE},
+  [BI_PARALLEL] = {"parallel", parallel, BUILTIN_OUTPUT},
+  [BI_ECHO] = {"echo", echo,
+               BUILTIN_OUTPUT | BUILTIN_CAPTURE | BUILTIN_BUFFERED,
+               echo_handles},
+  [BI_PRINTF] = {"printf", print_format,
+                 BUILTIN_OUTPUT | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_PWD] = {"pwd", pwd, BUILTIN_OUTPUT | BUILTIN_CAPTURE | BUILTIN_BUFFERED,
+              pwd_handles},
+  [BI_MEMO] = {"memo", memo, BUILTIN_ENV | BUILTIN_CAPTURE},
+  [BI_DIRCACHE] = {"dircache", dircache, BUILTIN_ENV | BUILTIN_CAPTURE},
+  [BI_BATCH] = {"batch", batch, BUILTIN_OUTPUT},
+  [BI_SET] = {"set", set_options, BUILTIN_ENV | BUILTIN_PIPESAFE |
+              BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_CAT] = {"cat", cat, BUILTIN_OUTPUT | BUILTIN_CAPTURE, copy_handles},
+  [BI_CP] = {"cp", cp, BUILTIN_OUTPUT | BUILTIN_CAPTURE, copy_handles},
+  [BI_TRUE] = {"true", true_builtin,
+               BUILTIN_PIPESAFE | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_FALSE] = {"false", false_builtin,
+                BUILTIN_PIPESAFE | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_TEST] = {"test", test,
+               BUILTIN_PIPESAFE | BUILTIN_CAPTURE | BUILTIN_BUFFERED},
+  [BI_BRACKET] = {"[", test,
+                  BUILTIN_PIPESAFE | BUILTIN_CAPTURE | BUILTIN_BUFFERED}
+};
+
+struct builtin *find_builtin(const char *name) {
+  // Length of name, only counted as far as the longest builtin
+  int len = 0;
+  while (name[len] != 0) {
+    if (++len > MAX_BUILTIN_LEN) {
+      return NULL;
+    }
+  }
+  // Pick the only possible candidate by length and leading characters
+  int index = -1;
+  switch (len) {
+    case 1:
+      if (name[0] == '[') {
+        index = BI_BRACKET;
+      }
+      break;
+    case 2:
+      if (name[0] == 'c') {
+        index = name[1] == 'd' ? BI_CD : BI_CP;
+      }
+      break;
+    case 3:
+      if (name[0] == 'c') {
+        index = BI_CAT;
+      } else if (name[0] == 'p') {
+        index = BI_PWD;
+      } else if (name[0] == 's') {
+        index = BI_SET;
+      }
+      break;
+    case 4:
+      if (name[0] == 'e') {
+        index = name[1] == 'x' ? BI_EXIT : BI_ECHO;
+      } else if (name[0] == 'h') {
+        index = BI_HASH;
+      } else if (name[0] == 'j') {
+        index = BI_JOBS;
+      } else if (name[0] == 'm') {
+        index = BI_MEMO;
+      } else if (name[0] == 't') {
+        index = name[1] == 'e' ? BI_TEST : BI_TRUE;
+      } else if (name[0] == 'w') {
+        index = BI_WAIT;
+      }
+      break;
+    case 5:
+      if (name[0] == 'b') {
+        index = BI_BATCH;
+      } else if (name[0] == 'f') {
+        index = BI_FALSE;
+      } else if (name[0] == 's') {
+        index = name[1] == 'h' ? BI_SHIFT : BI_SSTAT;
+      }
+      break;
+    case 6:
+      if (name[0] == 'e') {
+        index = BI_ENVSET;
+      } else if (name[0] == 'p') {
+        index = BI_PRINTF;
+      }
+      break;
+    case 7:
+      if (name[0] == 'u') {
+        index = BI_UNSHIFT;
+      }
+      break;
+    case 8:
+      if (name[0] == 'd') {
+        index = BI_DIRCACHE;
+      } else if (name[0] == 'e') {
+        index = BI_ENVUNSET;
+      } else if (name[0] == 'p') {
+        index = BI_PARALLEL;
+      }
+      break;
+    case 9:
+      if (name[0] == 'a') {
+        index = BI_ARENASTAT;
+      }
+      break;
+  }
+  // A single comparison confirms or rejects the candidate
+  if (index < 0 || strcmp(name, builtins[index].name)) {
+    return NULL;
+  }
+  return &builtins[index];
+}
+
+/*
+ * The builtin to run for a command, or NULL if it has to be spawned. Some
+ * only stand in for a program of the same name, and leave it any option
+ * they don't know.
+ */
+struct builtin *command_builtin(char **argpointers, int argc) {
+  struct builtin *builtin = find_builtin(argpointers[0]);
+  if (builtin != NULL && builtin->handles != NULL &&
+      !builtin->handles(argpointers, argc)) {
+    return NULL;
+  }
+  return builtin;
+}
+
+void run_builtin(struct builtin *builtin, char **argpointers, int argc,
+                 int infd, int outfd) {
+  builtin_infd = infd;
   builtin_outfd = outfd;
-  // Try to locate the correct builtin
-  int num_builtins = (int) (sizeof(builtins) / sizeof(builtins[0]));
-  for (int i = 0; i < num_builtins; i++) {
-    if (!strcmp(argpointers[0], builtins[i].name)) {
-      // Execute builtin passing arguments and argc
-      (*builtins[i].function)(argpointers, argc);
+  // Held output goes out first, unless this one adds to it as well
+  int outer = holding;
+  holding = (builtin->flags & BUILTIN_BUFFERED) && outfd == holdfd;
+  if (!holding) {
+    builtin_flush();
+  }
+  // Execute builtin passing arguments and argc
+  (*builtin->function)(argpointers, argc);
+  holding = outer;
+}
+
+/*
+ * Decide whether builtins may hold back what they write to the shell's
+ * stdout, so a run of echo lines costs one write() instead of one each.
+ * Not when it is a terminal, where someone is watching, or the same file as
+ * stderr, where errors written meanwhile would overtake it. Anything else
+ * that may write there calls builtin_flush() first.
+ */
+void builtin_hold_init(void) {
+  struct stat out, err;
+  heldlen = 0;
+  holdfd = -1;
+  if (isatty(1) || fstat(1, &out)) {
+    return;
+  }
+  if (!fstat(2, &err) && out.st_dev == err.st_dev &&
+      out.st_ino == err.st_ino) {
+    return;
+  }
+  holdfd = 1;
+}
+
+// Write out whatever is held, returns 0 if that failed
+int builtin_flush(void) {
+  if (heldlen == 0) {
+    return 1;
+  }
+  size_t len = heldlen;
+  heldlen = 0;
+  return write_all(holdfd, held, len);
+}
+
+int builtin_write(const char *data, size_t len) {
+  if (builtin_capture != NULL) {
+    // Straight into the line being expanded
+    size_t start = builtin_capture->buf->len;
+    if (!buffer_append(builtin_capture->buf, data, len)) {
+      fprintf(stderr, "Malloc of captured output failed.\n");
+      return 0;
+    }
+    capture_newlines(start);
+    return 1;
+  }
+  if (holding) {
+    if (heldlen + len > HOLD_SIZE && !builtin_flush()) {
+      return 0;
+    }
+    // Anything too big to hold goes straight out
+    if (len < HOLD_SIZE) {
+      memcpy(&held[heldlen], data, len);
+      heldlen += len;
       return 1;
     }
   }
-  return 0;
+  return write_all(builtin_outfd, data, len);
+}
+
+int builtin_printf(const char *format, ...) {
+  va_list args;
+  int ok;
+  va_start(args, format);
+  if (builtin_capture != NULL) {
+    size_t start = builtin_capture->buf->len;
+    ok = buffer_vprintf(builtin_capture->buf, format, args);
+    if (ok) {
+      capture_newlines(start);
+    } else {
+      fprintf(stderr, "Malloc of captured output failed.\n");
+    }
+  } else if (holding) {
+    struct buffer out;
+    ok = buffer_init(&out, 64) && buffer_vprintf(&out, format, args) &&
+         builtin_write(out.data, out.len);
+  } else {
+    ok = vdprintf(builtin_outfd, format, args) >= 0;
+  }
+  va_end(args);
+  return ok;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t chars = write(fd, data, len);
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      return 0;
+    }
+    data += chars;
+    len -= chars;
+  }
+  return 1;
+}
+
+static void capture_newlines(size_t start) {
+  struct buffer *buf = builtin_capture->buf;
+  if (start == buf->len) {
+    return;
+  }
+  // Same as reading it back from a pipe: the final newline is dropped later
+  // on, every other one becomes a space
+  builtin_capture->newline = buf->data[buf->len - 1] == '\n';
+  lex_unline(&buf->data[start], buf->len - start);
 }
 
 void exit_shell(char **argpointers, int argc) {
@@ -76,6 +417,10 @@ void envset(char **argpointers, int argc){
       perror("setenv");
       last_exit = 1;
     } else {
+      // Cached command locations are only valid for the old PATH
+      if (!strcmp(argpointers[1], "PATH")) {
+        hash_clear();
+      }
       last_exit = 0;
     }
   }
@@ -90,6 +435,10 @@ void envunset(char **argpointers, int argc) {
       perror("unsetenv");
       last_exit = 1;
     } else {
+      // Cached command locations are only valid for the old PATH
+      if (!strcmp(argpointers[1], "PATH")) {
+        hash_clear();
+      }
       last_exit = 0;
     }
   }
@@ -182,30 +531,711 @@ void sstat(char **argpointers, int argc) {
         continue;
       }
       // Print the file name
-      dprintf(builtin_outfd, "%s ", argpointers[i]);
+      builtin_printf("%s ", argpointers[i]);
       // Print the username, or UID if username isn't found
       struct passwd *userinfo = getpwuid(buf.st_uid);
       if (userinfo == NULL) {
-        dprintf(builtin_outfd, "%d ", buf.st_uid);
+        builtin_printf("%d ", buf.st_uid);
       } else {
-        dprintf(builtin_outfd, "%s ", userinfo->pw_name);
+        builtin_printf("%s ", userinfo->pw_name);
       }
       // Print the groupname, or GID if groupname isn't found
       struct group *groupinfo = getgrgid(buf.st_gid);
       if (groupinfo == NULL) {
-        dprintf(builtin_outfd, "%d ", buf.st_gid);
+        builtin_printf("%d ", buf.st_gid);
       } else {
-        dprintf(builtin_outfd, "%s ", groupinfo->gr_name);
+        builtin_printf("%s ", groupinfo->gr_name);
       }
       // Print the permission bits in a nice format
       char mode[12];
       strmode(buf.st_mode, mode);
-      dprintf(builtin_outfd, "%s", mode);
+      builtin_printf("%s", mode);
       // Get date and format it
       char *date = asctime(localtime(&buf.st_mtime));
       // Print number of links, size in bytes, and formatted date
-      dprintf(builtin_outfd, "%ld %ld %s", buf.st_nlink, buf.st_size, date);
+      builtin_printf("%ld %ld %s", buf.st_nlink, buf.st_size, date);
+    }
+    last_exit = exit_value;
+  }
+}
+
+void hash(char **argpointers, int argc) {
+  if (argc < 2) {
+    // List everything that has been looked up so far
+    hash_print(builtin_outfd);
+    last_exit = 0;
+  } else if (!strcmp(argpointers[1], "-r")) {
+    if (argc > 2) {
+      fprintf(stderr, "Usage: hash [-r] [NAME...]\n");
+      last_exit = 1;
+    } else {
+      hash_clear();
+      last_exit = 0;
+    }
+  } else {
+    int exit_value = 0;
+    // Seed the cache with every command specified
+    for (int i = 1; i < argc; i++) {
+      if (strchr(argpointers[i], '/') != NULL) {
+        fprintf(stderr, "hash: %s: not a command name\n", argpointers[i]);
+        exit_value = 1;
+      } else if (!hash_add(argpointers[i])) {
+        fprintf(stderr, "hash: %s: not found\n", argpointers[i]);
+        exit_value = 1;
+      }
     }
     last_exit = exit_value;
   }
 }
+
+void arenastat(char **argpointers, int argc) {
+  if (argc > 1) {
+    fprintf(stderr, "Usage: arenastat\n");
+    last_exit = 1;
+  } else {
+    size_t capacity, high_water;
+    int chunks;
+    arena_stats(&capacity, &chunks, &high_water);
+    builtin_printf("%zu bytes in %d chunks, high-water mark %zu bytes\n",
+                   capacity, chunks, high_water);
+    last_exit = 0;
+  }
+}
+
+void jobs(char **argpointers, int argc) {
+  if (argc > 1) {
+    fprintf(stderr, "Usage: jobs\n");
+    last_exit = 1;
+  } else {
+    job_print(builtin_outfd, 0);
+    last_exit = 0;
+  }
+}
+
+void wait_jobs(char **argpointers, int argc) {
+  if (argc < 2) {
+    // Wait for every background job, 130 if ^C cut that short
+    last_exit = job_wait_all() ? 0 : 130;
+    return;
+  }
+  int exit_value = 0;
+  // Wait for every job specified, the last one decides the exit value
+  for (int i = 1; i < argc; i++) {
+    int job = job_find(argpointers[i]);
+    if (job < 0) {
+      fprintf(stderr, "wait: %s: no such job\n", argpointers[i]);
+      exit_value = 127;
+      continue;
+    }
+    int status;
+    int waited = job_wait(job, &status);
+    if (waited < 0) {
+      exit_value = 130;
+      break;
+    }
+    exit_value = waited ? report_status(status, -1) : 0;
+    job_free(job);
+  }
+  last_exit = exit_value;
+}
+
+/*
+ * echo [-neE]... [STRING...]
+ *
+ * Options as /bin/echo takes them: -n leaves off the trailing newline, -e
+ * turns on backslash escapes and -E turns them off again. Anything else
+ * starting with '-' is printed like any other argument.
+ */
+void echo(char **argpointers, int argc) {
+  struct buffer out;
+  int newline = 1;
+  int escapes = 0;
+  int first = 1;
+  for (; first < argc; first++) {
+    char *arg = argpointers[first];
+    if (arg[0] != '-' || arg[1] == 0 || arg[1 + strspn(&arg[1], "neE")]) {
+      break;
+    }
+    for (char *p = &arg[1]; *p != 0; p++) {
+      newline = *p == 'n' ? 0 : newline;
+      escapes = *p == 'e' ? 1 : (*p == 'E' ? 0 : escapes);
+    }
+  }
+  if (!buffer_init(&out, 64)) {
+    fprintf(stderr, "Malloc of echo output failed.\n");
+    last_exit = 1;
+    return;
+  }
+  // Built up and written at once
+  int ok = 1;
+  for (int i = first; i < argc && ok; i++) {
+    ok = i == first || buffer_append(&out, " ", 1);
+    if (ok && escapes) {
+      int result = echo_escapes(argpointers[i], &out);
+      ok = result >= 0;
+      if (result > 0) {
+        // \c, nothing more at all
+        newline = 0;
+        break;
+      }
+    } else if (ok) {
+      ok = buffer_append(&out, argpointers[i], strlen(argpointers[i]));
+    }
+  }
+  if (ok && newline) {
+    ok = buffer_append(&out, "\n", 1);
+  }
+  if (!ok) {
+    fprintf(stderr, "Malloc of echo output failed.\n");
+    last_exit = 1;
+    return;
+  }
+  last_exit = builtin_write(out.data, out.len) ? 0 : 1;
+}
+
+void print_format(char **argpointers, int argc) {
+  struct buffer out;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: printf FORMAT [ARG...]\n");
+    last_exit = 1;
+    return;
+  }
+  if (!buffer_init(&out, 64)) {
+    fprintf(stderr, "Malloc of printf output failed.\n");
+    last_exit = 1;
+    return;
+  }
+  last_exit = 0;
+  int next = 2; // Next argument for a conversion
+  // The format is used again for as long as it uses up arguments
+  do {
+    int start = next;
+    const char *p = argpointers[1];
+    while (*p != 0) {
+      if (*p == '\\') {
+        p = format_escape(p + 1, &out);
+      } else if (*p == '%') {
+        int used = format_conversion(&p, next < argc ? argpointers[next] : NULL,
+                                     &out);
+        if (used < 0) {
+          last_exit = 1;
+          return;
+        }
+        next += used;
+      } else {
+        // Copy everything up to the next escape or conversion at once
+        size_t run = strcspn(p, "\\%");
+        if (!buffer_append(&out, p, run)) {
+          p = NULL;
+        } else {
+          p += run;
+        }
+      }
+      if (p == NULL) {
+        fprintf(stderr, "Malloc of printf output failed.\n");
+        last_exit = 1;
+        return;
+      }
+    }
+    if (next == start) {
+      break;
+    }
+  } while (next < argc);
+  if (!builtin_write(out.data, out.len)) {
+    last_exit = 1;
+  }
+}
+
+/*
+ * pwd [-L | -P]
+ *
+ * -P, the default as for /bin/pwd, prints the directory with every symbolic
+ * link resolved. -L prints $PWD instead, as long as it still names it.
+ */
+void pwd(char **argpointers, int argc) {
+  char cwd[PATH_MAX];
+  int logical = 0;
+  // The last one given wins
+  for (int i = 1; i < argc; i++) {
+    logical = argpointers[i][strlen(argpointers[i]) - 1] == 'L';
+  }
+  char *dir = logical ? logical_pwd() : NULL;
+  if (dir == NULL && (dir = getcwd(cwd, sizeof(cwd))) == NULL) {
+    perror("getcwd");
+    last_exit = 1;
+  } else {
+    last_exit = builtin_printf("%s\n", dir) ? 0 : 1;
+  }
+}
+
+/*
+ * set [-C | +C | -o OPTION | +o OPTION]
+ *
+ * -C, or -o noclobber, keeps > from replacing an existing file (>| still
+ * can), +C allows it again. -o concurrentsubs lets the $(...)s of a line run
+ * at the same time, for scripts whose substitutions don't depend on each
+ * other. With no arguments, prints the options and whether they are on.
+ */
+void set_options(char **argpointers, int argc) {
+  last_exit = 0;
+  if (argc == 1) {
+    builtin_printf("noclobber\t%s\n", noclobber ? "on" : "off");
+    builtin_printf("concurrentsubs\t%s\n", concurrent_subs ? "on" : "off");
+    return;
+  }
+  for (int i = 1; i < argc; i++) {
+    char *arg = argpointers[i];
+    int on = arg[0] == '-';
+    char *name = i + 1 < argc ? argpointers[i + 1] : "";
+    if ((arg[0] == '-' || arg[0] == '+') && arg[1] == 'C' && arg[2] == 0) {
+      noclobber = on;
+    } else if ((!strcmp(arg, "-o") || !strcmp(arg, "+o")) &&
+               !strcmp(name, "noclobber")) {
+      noclobber = on;
+      i++;
+    } else if ((!strcmp(arg, "-o") || !strcmp(arg, "+o")) &&
+               !strcmp(name, "concurrentsubs")) {
+      concurrent_subs = on;
+      i++;
+    } else {
+      fprintf(stderr, "Usage: set [-C | +C | -o OPTION | +o OPTION]\n");
+      last_exit = 1;
+      return;
+    }
+  }
+}
+
+void true_builtin(char **argpointers, int argc) {
+  last_exit = 0;
+}
+
+void false_builtin(char **argpointers, int argc) {
+  last_exit = 1;
+}
+
+/*
+ * test EXPRESSION
+ * [ EXPRESSION ]
+ *
+ * File tests (-e -f -d -h -L -p -S -b -c -r -w -x -s), string tests (-n,
+ * -z, =, == and != or just a string, true if it isn't empty), integer
+ * comparisons (-eq -ne -lt -le -gt -ge) and file comparisons (-nt -ot
+ * -ef), combined with !, -a, -o and parentheses. There is no < or >, the
+ * lexer takes those as redirections. Exits 0 if the expression is true, 1
+ * if it is false and 2 if it can't be made sense of.
+ */
+void test(char **argpointers, int argc) {
+  int end = argc;
+  if (argpointers[0][0] == '[') {
+    if (strcmp(argpointers[argc - 1], "]")) {
+      fprintf(stderr, "[: missing ']'\n");
+      last_exit = 2;
+      return;
+    }
+    end--;
+  }
+  // No expression at all is false
+  if (end == 1) {
+    last_exit = 1;
+    return;
+  }
+  int pos = 1;
+  int result = test_or(argpointers, &pos, end);
+  if (result >= 0 && pos < end) {
+    fprintf(stderr, "test: unexpected %s\n", argpointers[pos]);
+    result = -1;
+  }
+  last_exit = result < 0 ? 2 : !result;
+}
+
+// Anything but a lone --help or --version, which /bin/echo answers
+static int echo_handles(char **argpointers, int argc) {
+  return argc != 2 || (strcmp(argpointers[1], "--help") &&
+                       strcmp(argpointers[1], "--version"));
+}
+
+// Only -L and -P, /bin/pwd has the rest
+static int pwd_handles(char **argpointers, int argc) {
+  for (int i = 1; i < argc; i++) {
+    char *arg = argpointers[i];
+    if (arg[0] != '-' || arg[1] == 0 || arg[1 + strspn(&arg[1], "LP")]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Append arg with the escapes of echo -e, which are printf's plus \0NNN,
+ * \xHH and \c, less \". Returns 1 if \c cut the output short, 0 otherwise,
+ * or -1 if it couldn't be appended.
+ */
+static int echo_escapes(const char *arg, struct buffer *out) {
+  const char *p = arg;
+  while (*p != 0) {
+    const char *slash = strchr(p, '\\');
+    size_t len = slash != NULL ? (size_t) (slash - p) : strlen(p);
+    if (!buffer_append(out, p, len)) {
+      return -1;
+    }
+    if (slash == NULL) {
+      return 0;
+    }
+    p = slash + 1;
+    if (*p == 'c') {
+      return 1;
+    }
+    if (*p == '0' || (*p == 'x' && isxdigit((unsigned char) p[1]))) {
+      // Up to three octal or two hex digits
+      int base = *p == '0' ? 8 : 16;
+      int value = 0;
+      p++;
+      for (int n = 0; n < (base == 8 ? 3 : 2); n++, p++) {
+        int digit = isdigit((unsigned char) *p) ? *p - '0' :
+                    (isxdigit((unsigned char) *p) ?
+                     tolower((unsigned char) *p) - 'a' + 10 : base);
+        if (digit >= base) {
+          break;
+        }
+        value = value * base + digit;
+      }
+      char c = value;
+      if (!buffer_append(out, &c, 1)) {
+        return -1;
+      }
+    } else if (*p == '"' || *p == 'x') {
+      // Only printf knows these, they stay as they are
+      if (!buffer_append(out, slash, 2)) {
+        return -1;
+      }
+      p++;
+    } else if ((p = format_escape(p, out)) == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// $PWD, if it is absolute, free of . and .. and still the working directory
+static char *logical_pwd(void) {
+  struct stat env, dot;
+  char *dir = getenv("PWD");
+  if (dir == NULL || dir[0] != '/') {
+    return NULL;
+  }
+  for (char *p = dir; (p = strchr(p, '/')) != NULL;) {
+    p++;
+    if (p[0] == '.' && (p[1] == 0 || p[1] == '/' ||
+                        (p[1] == '.' && (p[2] == 0 || p[2] == '/')))) {
+      return NULL;
+    }
+  }
+  if (stat(dir, &env) || stat(".", &dot) || env.st_dev != dot.st_dev ||
+      env.st_ino != dot.st_ino) {
+    return NULL;
+  }
+  return dir;
+}
+
+static const char *format_escape(const char *p, struct buffer *out) {
+  char c;
+  switch (*p) {
+    case 'a':
+      c = '\a';
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'e':
+      c = '\033';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'n':
+      c = '\n';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    case 'v':
+      c = '\v';
+      break;
+    case '\\':
+    case '"':
+      c = *p;
+      break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7': {
+      // Up to three octal digits
+      int value = 0;
+      for (int n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++) {
+        value = value * 8 + *p - '0';
+      }
+      c = value;
+      return buffer_append(out, &c, 1) ? p : NULL;
+    }
+    case 0:
+      // A lone backslash at the end stays as it is
+      return buffer_append(out, "\\", 1) ? p : NULL;
+    default:
+      // So does one in front of anything it doesn't know
+      return buffer_append(out, p - 1, 2) ? p + 1 : NULL;
+  }
+  return buffer_append(out, &c, 1) ? p + 1 : NULL;
+}
+
+static int format_conversion(const char **format, char *arg,
+                             struct buffer *out) {
+  const char *p = *format + 1;
+  char spec[32];
+  char *end;
+  int ok;
+  // %% is a percent sign and uses up no argument
+  if (*p == '%') {
+    *format = p + 1;
+    return buffer_append(out, "%", 1) ? 0 : -1;
+  }
+  // Flags, width and precision are handed on to the C library as they are
+  size_t len = strspn(p, "-+ #0");
+  len += strspn(&p[len], "0123456789");
+  if (p[len] == '.') {
+    len++;
+    len += strspn(&p[len], "0123456789");
+  }
+  char conv = p[len];
+  if (conv == 0 || strchr("diouxXcseEfFgGaA", conv) == NULL ||
+      len + 4 > sizeof(spec)) {
+    fprintf(stderr, "printf: %.*s: invalid conversion\n",
+            (int) (len + (conv != 0) + 1), *format);
+    return -1;
+  }
+  *format = &p[len + 1];
+  spec[0] = '%';
+  memcpy(&spec[1], p, len);
+  len++;
+  if (strchr("dioxXu", conv) != NULL) {
+    // Integers are formatted as longs
+    spec[len++] = 'l';
+  }
+  spec[len++] = conv == 'c' && (arg == NULL || arg[0] == 0) ? 's' : conv;
+  spec[len] = 0;
+  // Numbers that don't parse print as 0, but make the exit value 1
+  long integer = 0;
+  unsigned long uinteger = 0;
+  double real = 0;
+  int numeric = strchr("diouxXeEfFgGaA", conv) != NULL;
+  if (arg != NULL && numeric) {
+    errno = 0;
+    if (conv == 'd' || conv == 'i') {
+      integer = strtol(arg, &end, 0);
+    } else if (strchr("ouxX", conv) != NULL) {
+      uinteger = strtoul(arg, &end, 0);
+    } else {
+      real = strtod(arg, &end);
+    }
+    if (end == arg || *end != 0 || errno) {
+      fprintf(stderr, "printf: %s: invalid number\n", arg);
+      last_exit = 1;
+    }
+  }
+  if (conv == 'd' || conv == 'i') {
+    ok = buffer_printf(out, spec, integer);
+  } else if (strchr("ouxX", conv) != NULL) {
+    ok = buffer_printf(out, spec, uinteger);
+  } else if (numeric) {
+    ok = buffer_printf(out, spec, real);
+  } else if (spec[len - 1] == 'c') {
+    ok = buffer_printf(out, spec, arg[0]);
+  } else {
+    ok = buffer_printf(out, spec, arg != NULL ? arg : "");
+  }
+  if (!ok) {
+    fprintf(stderr, "Malloc of printf output failed.\n");
+    return -1;
+  }
+  return arg != NULL;
+}
+
+/*
+ * The test expression parsers each read from args[*pos] up to end and move
+ * *pos past what they used. They return 1 for true, 0 for false or -1 after
+ * reporting an error. -o binds looser than -a, which binds looser than !.
+ */
+static int test_or(char **args, int *pos, int end) {
+  int result = test_and(args, pos, end);
+  while (result >= 0 && *pos < end && !strcmp(args[*pos], "-o")) {
+    (*pos)++;
+    int right = test_and(args, pos, end);
+    result = right < 0 ? -1 : result || right;
+  }
+  return result;
+}
+
+static int test_and(char **args, int *pos, int end) {
+  int result = test_not(args, pos, end);
+  while (result >= 0 && *pos < end && !strcmp(args[*pos], "-a")) {
+    (*pos)++;
+    int right = test_not(args, pos, end);
+    result = right < 0 ? -1 : result && right;
+  }
+  return result;
+}
+
+static int test_not(char **args, int *pos, int end) {
+  // A ! with nothing after it is just a string
+  if (*pos < end - 1 && !strcmp(args[*pos], "!")) {
+    (*pos)++;
+    int result = test_not(args, pos, end);
+    return result < 0 ? -1 : !result;
+  }
+  return test_primary(args, pos, end);
+}
+
+static int test_primary(char **args, int *pos, int end) {
+  if (*pos >= end) {
+    fprintf(stderr, "test: expression expected\n");
+    return -1;
+  }
+  char *arg = args[*pos];
+  // An operator in the middle comes first, so "-n = -n" compares strings
+  int op = *pos + 2 < end ? test_operator(args[*pos + 1]) : -1;
+  if (op >= 0) {
+    *pos += 3;
+    return test_binary(arg, op, args[*pos - 1]);
+  }
+  if (!strcmp(arg, "(") && *pos + 1 < end) {
+    (*pos)++;
+    int result = test_or(args, pos, end);
+    if (result >= 0 && (*pos >= end || strcmp(args[*pos], ")"))) {
+      fprintf(stderr, "test: missing )\n");
+      return -1;
+    }
+    (*pos)++;
+    return result;
+  }
+  if (arg[0] == '-' && arg[1] != 0 && arg[2] == 0 &&
+      strchr("efdhLpSbcrwxsnzt", arg[1]) != NULL && *pos + 1 < end) {
+    *pos += 2;
+    return test_unary(arg, args[*pos - 1]);
+  }
+  (*pos)++;
+  return arg[0] != 0;
+}
+
+static int test_operator(const char *op) {
+  for (int i = 0; i < NUM_TEST_BINARIES; i++) {
+    if (!strcmp(op, test_binaries[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int test_unary(const char *op, const char *arg) {
+  struct stat buf;
+  long fd;
+  switch (op[1]) {
+    case 'n':
+      return arg[0] != 0;
+    case 'z':
+      return arg[0] == 0;
+    case 't':
+      return test_integer(arg, &fd) ? isatty(fd) : -1;
+    case 'h':
+    case 'L':
+      return !lstat(arg, &buf) && S_ISLNK(buf.st_mode);
+    case 'r':
+      return !faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS);
+    case 'w':
+      return !faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS);
+    case 'x':
+      return !faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS);
+  }
+  // The rest are about what stat() says
+  if (stat(arg, &buf)) {
+    return 0;
+  }
+  switch (op[1]) {
+    case 'f':
+      return S_ISREG(buf.st_mode);
+    case 'd':
+      return S_ISDIR(buf.st_mode);
+    case 'p':
+      return S_ISFIFO(buf.st_mode);
+    case 'S':
+      return S_ISSOCK(buf.st_mode);
+    case 'b':
+      return S_ISBLK(buf.st_mode);
+    case 'c':
+      return S_ISCHR(buf.st_mode);
+    case 's':
+      return buf.st_size > 0;
+  }
+  // -e
+  return 1;
+}
+
+static int test_binary(const char *left, int op, const char *right) {
+  struct stat lbuf, rbuf;
+  long l, r;
+  if (op == TEST_SAME || op == TEST_SAME2) {
+    return !strcmp(left, right);
+  }
+  if (op == TEST_DIFFERENT) {
+    return strcmp(left, right) != 0;
+  }
+  if (op == TEST_NEWER || op == TEST_OLDER || op == TEST_SAME_FILE) {
+    // A file that isn't there is older than any that is
+    int lok = !stat(left, &lbuf);
+    int rok = !stat(right, &rbuf);
+    struct timespec *lt = &lbuf.st_mtim;
+    struct timespec *rt = &rbuf.st_mtim;
+    int newer = lok && (!rok || lt->tv_sec > rt->tv_sec ||
+                        (lt->tv_sec == rt->tv_sec && lt->tv_nsec > rt->tv_nsec));
+    int older = rok && (!lok || rt->tv_sec > lt->tv_sec ||
+                        (rt->tv_sec == lt->tv_sec && rt->tv_nsec > lt->tv_nsec));
+    if (op == TEST_NEWER) {
+      return newer;
+    }
+    if (op == TEST_OLDER) {
+      return older;
+    }
+    return lok && rok && lbuf.st_dev == rbuf.st_dev &&
+           lbuf.st_ino == rbuf.st_ino;
+  }
+  if (!test_integer(left, &l) || !test_integer(right, &r)) {
+    return -1;
+  }
+  switch (op) {
+    case TEST_EQ:
+      return l == r;
+    case TEST_NE:
+      return l != r;
+    case TEST_LT:
+      return l < r;
+    case TEST_LE:
+      return l <= r;
+    case TEST_GT:
+      return l > r;
+  }
+  return l >= r;
+}
+
+static int test_integer(const char *arg, long *value) {
+  char *end;
+  errno = 0;
+  *value = strtol(arg, &end, 10);
+  // Spaces around it are allowed, as in other shells
+  while (*end == ' ') {
+    end++;
+  }
+  if (end == arg || *end != 0 || errno) {
+    fprintf(stderr, "test: %s: integer expected\n", arg);
+    return 0;
+  }
+  return 1;
+}
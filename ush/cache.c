@@ -0,0 +1,422 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Compiled script cache. When USH_CACHE_DIR is set, a script run as
+ * "ush script" is lexed once into a file in that directory holding, for
+ * every line, where it is in the script, its expansion sites and, for lines
+ * with nothing to expand, its already split argv. Later runs of the same
+ * unchanged script (same path, size, mtime and inode) execute straight from
+ * that file without lexing anything.
+ *
+ * Layout: a struct cache_header, the script path padded to 4 bytes, then
+ * one struct cache_record per line followed by its sites and its argv blob
+ * padded to 4 bytes. An argv blob is the stage count, the background flag,
+ * each stage's argc, then every argument as a 0 terminated string.
+ */
+
+// Constants
+#define CACHE_MAGIC "USHC"
+#define CACHE_VERSION 5
+#define PAD4(n) (((n) + 3) & ~(size_t) 3)
+
+struct cache_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t nlines;
+  uint32_t pathlen;
+};
+
+struct cache_record {
+  uint32_t offset;
+  uint32_t len;
+  uint32_t flags;
+  uint32_t nsites;
+  uint32_t bloblen;
+};
+
+// In-memory image of a cache file while it is being built
+struct image {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+// Prototypes
+static char *cache_path(const char *script);
+static int cache_valid(struct script_cache *sc, struct stat *buf,
+                       const char *path);
+static int cache_compile(struct script_cache *sc, struct stat *buf,
+                         const char *path);
+static int image_append(struct image *img, const void *data, size_t len);
+static struct pipeline *unpack_blob(const char *blob, uint32_t bloblen);
+
+int script_cache_open(struct script_cache *sc, const char *path, int fd) {
+  memset(sc, 0, sizeof(struct script_cache));
+  if (getenv("USH_CACHE_DIR") == NULL) {
+    return 0;
+  }
+  struct stat buf;
+  if (fstat(fd, &buf) || !S_ISREG(buf.st_mode) || buf.st_size == 0 ||
+      buf.st_size > UINT32_MAX) {
+    return 0;
+  }
+  char *file = cache_path(path);
+  if (file == NULL) {
+    return 0;
+  }
+  // Map the script itself, records only point into it
+  sc->script = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (sc->script == MAP_FAILED) {
+    sc->script = NULL;
+    free(file);
+    return 0;
+  }
+  sc->scriptlen = buf.st_size;
+  // Use the cache file if it matches this exact script
+  int cachefd = open(file, O_RDONLY | O_CLOEXEC);
+  if (cachefd >= 0) {
+    struct stat cachebuf;
+    if (!fstat(cachefd, &cachebuf) &&
+        cachebuf.st_size >= (off_t) sizeof(struct cache_header)) {
+      sc->image = mmap(NULL, cachebuf.st_size, PROT_READ, MAP_SHARED, cachefd,
+                       0);
+      if (sc->image == MAP_FAILED) {
+        sc->image = NULL;
+      } else {
+        sc->imagelen = cachebuf.st_size;
+        sc->mapped = 1;
+      }
+    }
+    close(cachefd);
+    if (sc->image != NULL && cache_valid(sc, &buf, path)) {
+      free(file);
+      return 1;
+    }
+    if (sc->image != NULL) {
+      munmap(sc->image, sc->imagelen);
+      sc->image = NULL;
+      sc->mapped = 0;
+    }
+  }
+  // Miss, compile the script and save it for next time
+  if (!cache_compile(sc, &buf, path)) {
+    free(file);
+    script_cache_close(sc);
+    return 0;
+  }
+  char *tmp = malloc(strlen(file) + 16);
+  if (tmp != NULL) {
+    sprintf(tmp, "%s.%d", file, getpid());
+    int tmpfd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (tmpfd >= 0) {
+      // Written to the side and renamed, so readers never see half a file
+      if (write(tmpfd, sc->image, sc->imagelen) != (ssize_t) sc->imagelen ||
+          close(tmpfd) || rename(tmp, file)) {
+        unlink(tmp);
+      }
+    }
+    free(tmp);
+  }
+  free(file);
+  return 1;
+}
+
+int script_cache_next(struct script_cache *sc, char **lineptr,
+                      struct lineir *ir) {
+  struct cache_header *header = (struct cache_header *) sc->image;
+  if (sc->line >= header->nlines) {
+    return 0;
+  }
+  struct cache_record *rec = (struct cache_record *) &sc->image[sc->pos];
+  uint32_t *sites = (uint32_t *) &rec[1];
+  char *blob = (char *) &sites[rec->nsites];
+  sc->pos += sizeof(struct cache_record) + rec->nsites * sizeof(uint32_t) +
+             PAD4(rec->bloblen);
+  sc->line++;
+  // expand() writes into the line as it goes, so it gets its own copy
+  char *line = arena_alloc(rec->len + 1);
+  if (line == NULL) {
+    return 0;
+  }
+  memcpy(line, &sc->script[rec->offset], rec->len);
+  line[rec->len] = 0;
+  *lineptr = line;
+  ir->len = rec->len;
+  ir->flags = rec->flags;
+  ir->nsites = rec->nsites;
+  ir->sites = sites;
+  ir->pl = NULL;
+  if (rec->bloblen > 0 && (ir->pl = unpack_blob(blob, rec->bloblen)) == NULL) {
+    return 0;
+  }
+  return 1;
+}
+
+void script_cache_close(struct script_cache *sc) {
+  if (sc->script != NULL) {
+    munmap(sc->script, sc->scriptlen);
+  }
+  if (sc->mapped) {
+    munmap(sc->image, sc->imagelen);
+  } else {
+    free(sc->image);
+  }
+  memset(sc, 0, sizeof(struct script_cache));
+}
+
+static char *cache_path(const char *script) {
+  char *dir = getenv("USH_CACHE_DIR");
+  char *real = realpath(script, NULL);
+  if (real == NULL) {
+    return NULL;
+  }
+  // Name it after the script, the full path is checked inside the file
+  char *base = strrchr(real, '/') + 1;
+  char *file = malloc(strlen(dir) + strlen(base) + 32);
+  if (file != NULL) {
+    sprintf(file, "%s/%s.%08x.ushc", dir, base, hash_string(real));
+  }
+  free(real);
+  return file;
+}
+
+static int cache_valid(struct script_cache *sc, struct stat *buf,
+                       const char *path) {
+  struct cache_header *header = (struct cache_header *) sc->image;
+  char *real = realpath(path, NULL);
+  int valid = real != NULL && !memcmp(header->magic, CACHE_MAGIC, 4) &&
+              header->version == CACHE_VERSION &&
+              header->size == (uint64_t) buf->st_size &&
+              header->mtime_sec == buf->st_mtim.tv_sec &&
+              header->mtime_nsec == buf->st_mtim.tv_nsec &&
+              header->dev == buf->st_dev && header->ino == buf->st_ino &&
+              header->pathlen == strlen(real) &&
+              sizeof(struct cache_header) + PAD4(header->pathlen) <=
+              sc->imagelen &&
+              !memcmp(&header[1], real, header->pathlen);
+  free(real);
+  if (!valid) {
+    return 0;
+  }
+  // Walk the records once so a damaged file can't send us out of bounds
+  size_t pos = sizeof(struct cache_header) + PAD4(header->pathlen);
+  for (uint32_t i = 0; i < header->nlines; i++) {
+    if (pos + sizeof(struct cache_record) > sc->imagelen) {
+      return 0;
+    }
+    struct cache_record *rec = (struct cache_record *) &sc->image[pos];
+    uint32_t *sites = (uint32_t *) &rec[1];
+    if ((uint64_t) rec->offset + rec->len > sc->scriptlen ||
+        (rec->flags & ~(LEX_EXPAND | LEX_EMPTY)) ||
+        (rec->nsites > 0) != ((rec->flags & LEX_EXPAND) != 0)) {
+      return 0;
+    }
+    pos += sizeof(struct cache_record) + (size_t) rec->nsites *
+           sizeof(uint32_t) + PAD4(rec->bloblen);
+    if (pos > sc->imagelen) {
+      return 0;
+    }
+    // expand() copies the line between sites, they must be inside it and in
+    // the order the lexer found them
+    for (uint32_t k = 0; k < rec->nsites; k++) {
+      if (sites[k] >= rec->len || (k > 0 && sites[k] <= sites[k - 1])) {
+        return 0;
+      }
+    }
+  }
+  sc->pos = sizeof(struct cache_header) + PAD4(header->pathlen);
+  return 1;
+}
+
+static int cache_compile(struct script_cache *sc, struct stat *buf,
+                         const char *path) {
+  struct image img = {NULL, 0, 0};
+  struct cache_header header;
+  char *real = realpath(path, NULL);
+  if (real == NULL) {
+    return 0;
+  }
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  header.version = CACHE_VERSION;
+  header.size = buf->st_size;
+  header.mtime_sec = buf->st_mtim.tv_sec;
+  header.mtime_nsec = buf->st_mtim.tv_nsec;
+  header.dev = buf->st_dev;
+  header.ino = buf->st_ino;
+  header.nlines = 0;
+  header.pathlen = strlen(real);
+  static const char zeros[4];
+  if (!image_append(&img, &header, sizeof(header)) ||
+      !image_append(&img, real, header.pathlen) ||
+      !image_append(&img, zeros, PAD4(header.pathlen) - header.pathlen)) {
+    free(real);
+    free(img.data);
+    return 0;
+  }
+  free(real);
+  // Compile every line exactly the way processline() would
+  size_t pos = 0;
+  while (pos < sc->scriptlen) {
+    char *start = &sc->script[pos];
+    char *newline = memchr(start, '\n', sc->scriptlen - pos);
+    size_t len = newline == NULL ? sc->scriptlen - pos : newline - start;
+    char *line = arena_alloc(len + 1);
+    if (line == NULL) {
+      free(img.data);
+      return 0;
+    }
+    memcpy(line, start, len);
+    line[len] = 0;
+    struct lineir ir;
+    if (!lex_compile(line, &ir)) {
+      free(img.data);
+      return 0;
+    }
+    struct cache_record rec = {pos, ir.len, ir.flags, ir.nsites, 0};
+    // Lines with nothing to expand are split now, unless they would fail or
+    // have redirections or a |+, which an argv blob has no room for
+    struct pipeline pl;
+    int quotes = 0;
+    for (size_t i = 0; i < ir.len; i++) {
+      quotes += line[i] == '"';
+    }
+    struct image blob = {NULL, 0, 0};
+    if (!(ir.flags & (LEX_EXPAND | LEX_EMPTY)) && quotes % 2 == 0 &&
+        memchr(line, '<', ir.len) == NULL && memchr(line, '>', ir.len) == NULL &&
+        memmem(line, ir.len, "|+", 2) == NULL && lex_split(line, &pl)) {
+      uint32_t count = pl.nstages;
+      int ok = image_append(&blob, &count, sizeof(count));
+      count = pl.background;
+      ok = ok && image_append(&blob, &count, sizeof(count));
+      for (int i = 0; i < pl.nstages && ok; i++) {
+        count = pl.stages[i].argc;
+        ok = image_append(&blob, &count, sizeof(count));
+      }
+      for (int i = 0; i < pl.nstages && ok; i++) {
+        for (int j = 0; j < pl.stages[i].argc && ok; j++) {
+          char *arg = pl.stages[i].argv[j];
+          ok = image_append(&blob, arg, strlen(arg) + 1);
+        }
+      }
+      if (!ok) {
+        free(blob.data);
+        free(img.data);
+        return 0;
+      }
+      rec.bloblen = blob.len;
+    }
+    uint32_t sites[ir.nsites + 1];
+    for (int i = 0; i < ir.nsites; i++) {
+      sites[i] = ir.sites[i];
+    }
+    int ok = image_append(&img, &rec, sizeof(rec)) &&
+             image_append(&img, sites, sizeof(uint32_t) * ir.nsites) &&
+             image_append(&img, blob.data, blob.len) &&
+             image_append(&img, zeros, PAD4(blob.len) - blob.len);
+    free(blob.data);
+    if (!ok) {
+      free(img.data);
+      return 0;
+    }
+    ((struct cache_header *) img.data)->nlines++;
+    arena_reset();
+    pos += len + 1;
+  }
+  sc->image = img.data;
+  sc->imagelen = img.len;
+  sc->mapped = 0;
+  sc->pos = sizeof(struct cache_header) + PAD4(header.pathlen);
+  return 1;
+}
+
+static int image_append(struct image *img, const void *data, size_t len) {
+  if (img->len + len > img->size) {
+    size_t size = img->size ? img->size * 2 : 4096;
+    while (size < img->len + len) {
+      size *= 2;
+    }
+    char *bigger = realloc(img->data, size);
+    if (bigger == NULL) {
+      fprintf(stderr, "Realloc of script cache image failed.\n");
+      return 0;
+    }
+    img->data = bigger;
+    img->size = size;
+  }
+  if (len > 0) {
+    memcpy(&img->data[img->len], data, len);
+  }
+  img->len += len;
+  return 1;
+}
+
+static struct pipeline *unpack_blob(const char *blob, uint32_t bloblen) {
+  const uint32_t *counts = (const uint32_t *) blob;
+  uint32_t nstages = counts[0];
+  size_t header = sizeof(uint32_t) * ((size_t) nstages + 2);
+  if (bloblen < 2 * sizeof(uint32_t) || nstages == 0 || header > bloblen ||
+      blob[bloblen - 1] != 0) {
+    fprintf(stderr, "Damaged script cache record.\n");
+    return NULL;
+  }
+  // Copy the strings out, argv must be writable like a lexed line's
+  char *strings = arena_alloc(bloblen - header + 1);
+  char *end = strings + (bloblen - header);
+  struct pipeline *pl = arena_alloc(sizeof(struct pipeline));
+  struct stage *stages = arena_alloc(sizeof(struct stage) * nstages);
+  if (strings == NULL || pl == NULL || stages == NULL) {
+    return NULL;
+  }
+  memcpy(strings, &blob[header], bloblen - header);
+  for (uint32_t i = 0; i < nstages; i++) {
+    int argc = counts[i + 2];
+    if (counts[i + 2] > bloblen - header) {
+      fprintf(stderr, "Damaged script cache record.\n");
+      return NULL;
+    }
+    char **argv = arena_alloc(sizeof(char *) * (argc + 1));
+    if (argv == NULL) {
+      return NULL;
+    }
+    for (int j = 0; j < argc; j++) {
+      if (strings >= end) {
+        fprintf(stderr, "Damaged script cache record.\n");
+        return NULL;
+      }
+      argv[j] = strings;
+      strings += strlen(strings) + 1;
+    }
+    argv[argc] = NULL;
+    stages[i].argv = argv;
+    stages[i].argc = argc;
+    stages[i].redirs = NULL;
+    stages[i].fanout = 0;
+  }
+  pl->stages = stages;
+  pl->nstages = nstages;
+  pl->background = counts[1];
+  return pl;
+}
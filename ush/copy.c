@@ -0,0 +1,278 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * cat [FILE...]
+ * cp SOURCE DEST
+ * cp SOURCE... DIRECTORY
+ *
+ * Copying without a fork, and where the kernel allows, without the data
+ * passing through the shell at all: copy_file_range() between regular files
+ * (a reflink on file systems that share extents), splice() when either side
+ * is a pipe, sendfile() from a regular file to anything else, and read()
+ * and write() for what is left, like a terminal. A method the kernel turns
+ * down for a pair of fds falls back to the next one, carrying on from
+ * wherever it got to.
+ *
+ * cat reads standard input when it has no files or is given "-". Inside a
+ * $(...) it writes into the capture instead. Input that isn't a regular file
+ * is waited for with poll(), which ^C interrupts even though the shell's
+ * handler restarts other calls.
+ *
+ * Neither takes any options. A command with one, anything but a lone "-"
+ * that starts with '-', runs /bin/cat or /bin/cp as it did before.
+ */
+
+// Constants
+#define COPY_CHUNK (16 << 20) // Most one call is asked to move
+#define COPY_SIZE 65536 // Buffer for read() and write()
+
+// Methods, from fastest to the one that always works
+#define COPY_RANGE 0
+#define COPY_SPLICE 1
+#define COPY_SENDFILE 2
+#define COPY_READ 3
+
+// Prototypes
+static int copy_fd(int infd, int outfd, const char *cmd, const char *name);
+static int copy_buffered(int infd, int outfd, const char *cmd,
+                         const char *name);
+static int wait_readable(int fd);
+static int cp_file(const char *source, const char *dest);
+
+// For the builtins table, 0 if any argument is an option
+int copy_handles(char **argpointers, int argc) {
+  for (int i = 1; i < argc; i++) {
+    if (argpointers[i][0] == '-' && argpointers[i][1] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void cat(char **argpointers, int argc) {
+  int exit_value = 0;
+  int nfiles = argc > 1 ? argc - 1 : 1;
+  for (int i = 0; i < nfiles && !sigint_caught; i++) {
+    char *name = argc > 1 ? argpointers[i + 1] : "-";
+    int fd = builtin_infd;
+    if (strcmp(name, "-") && (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      exit_value = 1;
+      continue;
+    }
+    // A capture gets its bytes through builtin_write() to fix up newlines
+    int result = builtin_capture != NULL ?
+                 copy_buffered(fd, -1, "cat", name) :
+                 copy_fd(fd, builtin_outfd, "cat", name);
+    if (result < 0) {
+      exit_value = 1;
+    }
+    if (fd != builtin_infd) {
+      close(fd);
+    }
+  }
+  last_exit = sigint_caught ? 130 : exit_value;
+}
+
+void cp(char **argpointers, int argc) {
+  struct stat buf;
+  if (argc < 3) {
+    fprintf(stderr, "Usage: cp SOURCE DEST | cp SOURCE... DIRECTORY\n");
+    last_exit = 1;
+    return;
+  }
+  char *target = argpointers[argc - 1];
+  int into_dir = !stat(target, &buf) && S_ISDIR(buf.st_mode);
+  if (argc > 3 && !into_dir) {
+    fprintf(stderr, "cp: target '%s' is not a directory\n", target);
+    last_exit = 1;
+    return;
+  }
+  int exit_value = 0;
+  for (int i = 1; i < argc - 1 && !sigint_caught; i++) {
+    char dest[PATH_MAX];
+    char *source = argpointers[i];
+    if (into_dir) {
+      // basename() may write to its argument, give it a copy
+      char name[PATH_MAX];
+      snprintf(name, sizeof(name), "%s", source);
+      if (snprintf(dest, sizeof(dest), "%s/%s", target, basename(name)) >=
+          (int) sizeof(dest)) {
+        fprintf(stderr, "cp: %s/%s: File name too long\n", target, name);
+        exit_value = 1;
+        continue;
+      }
+    } else {
+      snprintf(dest, sizeof(dest), "%s", target);
+    }
+    if (cp_file(source, dest) < 0) {
+      exit_value = 1;
+    }
+  }
+  last_exit = sigint_caught ? 130 : exit_value;
+}
+
+/*
+ * Copy everything left in infd to outfd. Returns 0 once infd runs out, or
+ * -1 after reporting a failure (or on ^C).
+ */
+static int copy_fd(int infd, int outfd, const char *cmd, const char *name) {
+  struct stat in, out;
+  if (fstat(infd, &in) || fstat(outfd, &out)) {
+    fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+    return -1;
+  }
+  if (S_ISREG(in.st_mode) && in.st_dev == out.st_dev &&
+      in.st_ino == out.st_ino) {
+    // It would never reach the end
+    fprintf(stderr, "%s: %s: input file is output file\n", cmd, name);
+    return -1;
+  }
+  int method = COPY_READ;
+  if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode)) {
+    method = COPY_RANGE;
+  } else if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)) {
+    method = COPY_SPLICE;
+  } else if (S_ISREG(in.st_mode)) {
+    method = COPY_SENDFILE;
+  }
+  while (!sigint_caught) {
+    if (method == COPY_READ) {
+      return copy_buffered(infd, outfd, cmd, name);
+    }
+    if (!S_ISREG(in.st_mode) && !wait_readable(infd)) {
+      return -1;
+    }
+    ssize_t chars;
+    if (method == COPY_RANGE) {
+      chars = copy_file_range(infd, NULL, outfd, NULL, COPY_CHUNK, 0);
+    } else if (method == COPY_SPLICE) {
+      chars = splice(infd, NULL, outfd, NULL, COPY_CHUNK,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else {
+      chars = sendfile(outfd, infd, NULL, COPY_CHUNK);
+    }
+    if (chars == 0) {
+      return 0;
+    }
+    if (chars > 0 || errno == EINTR) {
+      continue;
+    }
+    // Not for this pair of fds (an O_APPEND file, across file systems on
+    // an old kernel, a terminal), try the next way
+    if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+        errno == EOPNOTSUPP || (method == COPY_RANGE && errno == EBADF)) {
+      method = method == COPY_RANGE || (method == COPY_SPLICE &&
+               S_ISREG(in.st_mode)) ? COPY_SENDFILE : COPY_READ;
+      continue;
+    }
+    fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+    return -1;
+  }
+  return -1;
+}
+
+// The plain way, into the capture if outfd is -1
+static int copy_buffered(int infd, int outfd, const char *cmd,
+                         const char *name) {
+  char buf[COPY_SIZE];
+  ssize_t chars;
+  while (!sigint_caught) {
+    if (!wait_readable(infd)) {
+      return -1;
+    }
+    if ((chars = read(infd, buf, sizeof(buf))) == 0) {
+      return 0;
+    }
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+      return -1;
+    }
+    if (outfd < 0) {
+      if (!builtin_write(buf, chars)) {
+        return -1;
+      }
+      continue;
+    }
+    for (ssize_t written = 0; written < chars;) {
+      ssize_t n = write(outfd, &buf[written], chars - written);
+      if (n < 0 && errno != EINTR) {
+        perror("write");
+        return -1;
+      }
+      written += n > 0 ? n : 0;
+    }
+  }
+  return -1;
+}
+
+static int wait_readable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  // Not restarted after a signal, so ^C gets through
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR || sigint_caught) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int cp_file(const char *source, const char *dest) {
+  struct stat in, out;
+  int infd = open(source, O_RDONLY | O_CLOEXEC);
+  if (infd < 0 || fstat(infd, &in)) {
+    fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+    if (infd >= 0) {
+      close(infd);
+    }
+    return -1;
+  }
+  if (S_ISDIR(in.st_mode)) {
+    fprintf(stderr, "cp: %s: Is a directory, not copied\n", source);
+    close(infd);
+    return -1;
+  }
+  if (!stat(dest, &out) && out.st_dev == in.st_dev &&
+      out.st_ino == in.st_ino) {
+    fprintf(stderr, "cp: '%s' and '%s' are the same file\n", source, dest);
+    close(infd);
+    return -1;
+  }
+  int outfd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   in.st_mode & 07777);
+  if (outfd < 0) {
+    fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+    close(infd);
+    return -1;
+  }
+  int result = copy_fd(infd, outfd, "cp", source);
+  close(infd);
+  if (close(outfd)) {
+    fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+    result = -1;
+  }
+  return result;
+}
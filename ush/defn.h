@@ -6,22 +6,263 @@
 
 #pragma once
 
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
 // Global Constants
 #define WAIT 1
 #define NOWAIT 0
 #define EXPAND 2
 #define NOEXPAND 0
+#define CAPTURE 4 // Output goes to the capture set up by expand() for $(...)
+#define PIPED 8 // Output goes to a pipe whose reader may not be running yet
+
+// Builtin flags
+#define BUILTIN_PIPESAFE 1 // Safe to run in the parent as any pipeline stage
+#define BUILTIN_ENV 2 // Changes the shell's own state, must run in the parent
+#define BUILTIN_OUTPUT 4 // Only produces output, may run in a child
+#define BUILTIN_CAPTURE 8 // Writes only through builtin_write/printf()
+#define BUILTIN_BUFFERED 16 // Same, even outside a capture, so may be held
+
+// Redirection types
+#define REDIR_IN 0 // <
+#define REDIR_OUT 1 // >
+#define REDIR_APPEND 2 // >>
+#define REDIR_CLOBBER 3 // >|, writes over a file even with noclobber set
+#define REDIR_DUP 4 // >&N or <&N
+
+// Lexer flags
+#define LEX_EXPAND 1 // Line has something for expand() to do
+#define LEX_EMPTY 2 // Line is blank once comments are removed
+
+// Put by expand() in front of a '<', '>' or '&' that came from an expansion,
+// lex_split() drops it and takes the byte after it as a plain character
+#define LEX_LITERAL '\001'
+
+// Tracing hooks, a single test of trace_enabled when tracing is off
+#define TRACE_BEGIN(name, detail) \
+  do { if (trace_enabled) trace_event('B', name, detail); } while (0)
+#define TRACE_END(name) \
+  do { if (trace_enabled) trace_event('E', name, NULL); } while (0)
+
+// time keyword output formats
+#define TIME_TEXT 1
+#define TIME_JSON 2
+
+// Global Types
+typedef void (*funcptr)(char **, int argc);
+struct builtin {
+  char *name;
+  funcptr function;
+  int flags;
+  // NULL if it takes any arguments, else 0 leaves these to the program
+  int (*handles)(char **, int argc);
+};
+// One redirection of a stage, applied in the order they were written
+struct redirect {
+  int fd; // 0, 1 or 2
+  int type;
+  char *path; // File to open, for everything but REDIR_DUP
+  int dupfd; // Descriptor fd becomes a copy of, for REDIR_DUP
+  struct redirect *next;
+};
+// One command of a pipeline
+struct stage {
+  char **argv;
+  int argc;
+  struct redirect *redirs;
+  int fanout; // Came after a |+, reads the same stream as the rest of its run
+};
+// Lexed line, argv strings point into the line itself
+struct pipeline {
+  struct stage *stages;
+  int nstages;
+  int background; // Line ended in '&'
+};
+// Line as compiled by the lexer, ahead of any expansion
+struct lineir {
+  size_t len; // Length once the comment is stripped
+  int flags;
+  int nsites;
+  unsigned int *sites; // Offsets of every '$' and '*' expand() must look at
+  struct pipeline *pl; // Already split stages, only for lines with no sites
+};
+// Script input, either mapped whole or read in large chunks
+struct reader {
+  int fd;
+  char *map;
+  size_t maplen;
+  size_t pos;
+  char *buf;
+  size_t bufsize;
+  size_t start;
+  size_t end;
+  int eof;
+};
+// Compiled form of a script file, see cache.c
+struct script_cache {
+  char *script;
+  size_t scriptlen;
+  char *image;
+  size_t imagelen;
+  int mapped;
+  size_t pos;
+  unsigned int line;
+};
+// One process of a job, see jobs.c
+struct child {
+  pid_t pid; // Negated once reaped
+  int pidfd;
+  int stage; // Index into the pipeline
+  struct timespec started;
+  struct timespec ended;
+  struct rusage usage;
+};
+// Point in the line arena to go back to, see arena_release()
+struct arena_mark {
+  void *chunk;
+  size_t used;
+  size_t in_use;
+};
+// Growable string allocated from the line arena
+struct buffer {
+  char *data;
+  size_t len;
+  size_t size;
+};
+// Output of a $(...) on its way into the expanded line
+struct capture {
+  struct buffer *buf;
+  int fd; // Pipe to read it from, -1 if it was written straight into buf
+  int newline; // Last byte written straight into buf was a newline
+};
+// Names in one directory, see dircache.c
+struct dirlist {
+  char *names; // Each one 0 terminated
+  size_t len;
+  unsigned char *types; // d_type of each name
+  int count;
+  int users;
+  int cached; // "Boolean" representing if it is still in the cache
+};
+// A recursive walk below root, names come back relative to it
+struct treewalk {
+  const char *root; // "" for the working directory
+  int (*match)(void *arg, const char *name); // NULL matches everything
+  void *arg;
+  int hidden; // "Boolean" representing if names starting with '.' can match
+  int dirs_only; // Only match directories, and give them a trailing '/'
+  int max_depth;
+  long max_matches;
+  char *names; // Malloced, each one 0 terminated
+  size_t len;
+  long count;
+};
 
 // Global Prototypes
 int processline(char *line, int infd, int outfd, int flags);
-int expand(char *orig, char *new, int newsize);
-int check_for_builtin(char **argpointers, int argc, int outfd);
+int execute_line(char *line, struct lineir *ir, int infd, int outfd,
+                 int flags);
+int run_pipeline(struct pipeline *pl, int infd, int outfd, int flags);
+int expand(char *orig, struct lineir *ir, struct buffer *new);
+struct builtin *find_builtin(const char *name);
+struct builtin *command_builtin(char **argpointers, int argc);
+void run_builtin(struct builtin *builtin, char **argpointers, int argc,
+                 int infd, int outfd);
+int builtin_write(const char *data, size_t len);
+int builtin_printf(const char *format, ...);
+void builtin_hold_init(void);
+int builtin_flush(void);
+void parallel(char **argpointers, int argc);
+void batch(char **argpointers, int argc);
+void cat(char **argpointers, int argc);
+void cp(char **argpointers, int argc);
+int copy_handles(char **argpointers, int argc);
+void memo(char **argpointers, int argc);
+int spawn_command(char **argpointers, int infd, int outfd, int errfd,
+                  pid_t pgid);
+pid_t spawn_builtin(struct builtin *builtin, char **argpointers, int argc,
+                    int fds[3], pid_t pgid);
+pid_t fanout(int infd, int *readfds, int n, pid_t pgid);
 void strmode(mode_t mode, char *p);
+unsigned int hash_string(const char *str);
+char *hash_lookup(const char *name);
+int hash_add(const char *name);
+void hash_remove(const char *name);
+void hash_clear(void);
+void hash_print(int outfd);
+int glob_pattern(const char *word);
+int glob_expand(const char *pattern, struct buffer *out);
+int tree_walk(struct treewalk *tw);
+struct dirlist *dircache_read(const char *path);
+void dircache_release(struct dirlist *list);
+void dircache_clear(void);
+void dircache(char **argpointers, int argc);
+char *memo_key(const char *cmd);
+int memo_get(const char *key, struct buffer *out);
+void memo_put(const char *key, const char *value, size_t len);
+void memo_clear(void);
+void *arena_alloc(size_t size);
+void *arena_grow(void *ptr, size_t oldsize, size_t newsize);
+void arena_reset(void);
+void arena_mark(struct arena_mark *mark);
+void arena_release(struct arena_mark *mark);
+void arena_stats(size_t *capacity, int *chunks, size_t *high_water);
+int buffer_init(struct buffer *buf, size_t size);
+int buffer_reserve(struct buffer *buf, size_t extra);
+int buffer_append(struct buffer *buf, const char *str, size_t len);
+int buffer_printf(struct buffer *buf, const char *format, ...);
+int buffer_vprintf(struct buffer *buf, const char *format, va_list args);
+int reader_open(struct reader *rd, int fd);
+char *reader_next(struct reader *rd, size_t *lenptr);
+void reader_close(struct reader *rd);
+size_t lex_scan(const char *s, size_t i, const char *set);
+void lex_unline(char *s, size_t len);
+int lex_compile(char *line, struct lineir *ir);
+int lex_split(char *line, struct pipeline *pl);
+int script_cache_open(struct script_cache *sc, const char *path, int fd);
+int script_cache_next(struct script_cache *sc, char **lineptr,
+                      struct lineir *ir);
+void script_cache_close(struct script_cache *sc);
+int job_start(struct pipeline *pl);
+pid_t job_pgid(int job);
+int job_add(int job, pid_t pid, int stage);
+int job_wait(int job, int *statusptr);
+int job_wait_any(int *jobs, int n);
+int job_wait_all(void);
+int job_find(const char *spec);
+void job_free(int job);
+void job_forget(void);
+int job_id(int job);
+pid_t job_last_pid(int job);
+int job_count(int job);
+struct child *job_child(int job, int k);
+void job_reap(void);
+void job_print(int outfd, int done_only);
+int report_status(int status, int outfd);
+int time_keyword(struct pipeline *pl);
+void trace_open(void);
+void trace_close(void);
+void trace_event(char phase, const char *name, const char *detail);
+void trace_child(const char *name, struct timespec *started,
+                 struct timespec *ended, pid_t pid);
+void time_report(struct pipeline *pl, int job, struct timespec *started,
+                 int format, int outfd);
 
 // Global Variables
 int mainargc;
+int interactive; // "Boolean" representing if the shell is in interactive mode
 char **mainargv;
 int cur_shift;
 int last_exit;
 int sigint_caught;
 int waiting_on;
+int builtin_infd;
+int builtin_outfd;
+struct capture *capture; // Where a line run with CAPTURE sends its output
+struct capture *builtin_capture; // Set while a builtin writes into a capture
+int trace_enabled;
+int noclobber; // "Boolean" representing if > may not replace a file
+int concurrent_subs; // "Boolean" representing if $(...)s on a line may overlap
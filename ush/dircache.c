@@ -0,0 +1,317 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Directory listing cache for wildcard expansion. Listings are kept per
+ * directory, found by the (device, inode) a stat() of the path gives, and
+ * reused while the directory's mtime and ctime haven't changed, so a glob
+ * repeated over an unchanged directory only filters names in memory.
+ *
+ * Time stamps only change once per clock tick, so a listing read less than
+ * a second after the directory last changed could miss a change made in
+ * the same tick; those are used once and not kept. USH_DIRCACHE picks the
+ * mode: "off" reads every directory every time, "inotify" also watches
+ * each cached directory and drops its listing as soon as an event arrives
+ * (which makes fresh listings safe to keep too), anything else validates
+ * with time stamps alone.
+ *
+ * dircache [-c]
+ *
+ * Prints the cached directories and the hit and miss counts, -c empties it.
+ */
+
+// Constants
+#define DIRCACHE_MAX 64
+#define NAMES_START 1024
+#define ENTRIES_START 32
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// Modes
+#define DIRCACHE_OFF 0
+#define DIRCACHE_STAT 1
+#define DIRCACHE_INOTIFY 2
+
+// A listing and what it was read from, list comes first for dircache_release()
+struct dirslot {
+  struct dirlist list;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  struct timespec ctime;
+  int wd; // Inotify watch, -1 if there isn't one
+  unsigned long used; // When it was last handed out
+  char *path; // As it was first read, for showing
+};
+
+// Prototypes
+static int dircache_mode(void);
+static struct dirslot *read_listing(const char *path, int mode);
+static int keep_listing(struct dirslot *slot, const char *path, int mode);
+static void drain_events(void);
+static void drop_slot(int index);
+static void free_slot(struct dirslot *slot);
+
+// Global Variables
+static struct dirslot *slots[DIRCACHE_MAX];
+static int nslots;
+static unsigned long uses;
+static long dircache_hits;
+static long dircache_misses;
+static int inotifyfd = -1;
+
+struct dirlist *dircache_read(const char *path) {
+  struct stat buf;
+  int mode = dircache_mode();
+  if (stat(path, &buf) || !S_ISDIR(buf.st_mode)) {
+    return NULL;
+  }
+  drain_events();
+  for (int i = 0; i < nslots; i++) {
+    struct dirslot *slot = slots[i];
+    if (slot->dev != buf.st_dev || slot->ino != buf.st_ino) {
+      continue;
+    }
+    // A watch would have dropped it already, otherwise check the stamps
+    if (mode != DIRCACHE_OFF &&
+        slot->mtime.tv_sec == buf.st_mtim.tv_sec &&
+        slot->mtime.tv_nsec == buf.st_mtim.tv_nsec &&
+        slot->ctime.tv_sec == buf.st_ctim.tv_sec &&
+        slot->ctime.tv_nsec == buf.st_ctim.tv_nsec) {
+      slot->used = ++uses;
+      slot->list.users++;
+      dircache_hits++;
+      return &slot->list;
+    }
+    drop_slot(i);
+    break;
+  }
+  dircache_misses++;
+  struct dirslot *slot = read_listing(path, mode);
+  if (slot == NULL) {
+    return NULL;
+  }
+  slot->list.users++;
+  return &slot->list;
+}
+
+void dircache_release(struct dirlist *list) {
+  if (list != NULL && --list->users == 0 && !list->cached) {
+    free_slot((struct dirslot *) list);
+  }
+}
+
+void dircache_clear(void) {
+  while (nslots > 0) {
+    drop_slot(nslots - 1);
+  }
+  dircache_hits = 0;
+  dircache_misses = 0;
+}
+
+void dircache(char **argpointers, int argc) {
+  // Parse options
+  if (argc > 2 || (argc == 2 && strcmp(argpointers[1], "-c"))) {
+    fprintf(stderr, "Usage: dircache [-c]\n");
+    last_exit = 1;
+    return;
+  }
+  last_exit = 0;
+  if (argc == 2) {
+    dircache_clear();
+    return;
+  }
+  for (int i = 0; i < nslots; i++) {
+    if (i == 0) {
+      builtin_printf("entries\twatched\tdirectory\n");
+    }
+    builtin_printf("%7d\t%s\t%s\n", slots[i]->list.count,
+                   slots[i]->wd >= 0 ? "yes" : "no", slots[i]->path);
+  }
+  static const char *modes[] = {"off", "stat", "inotify"};
+  builtin_printf("%d directories, %ld hits, %ld misses, mode %s\n", nslots,
+                 dircache_hits, dircache_misses, modes[dircache_mode()]);
+}
+
+static int dircache_mode(void) {
+  char *value = getenv("USH_DIRCACHE");
+  if (value == NULL) {
+    return DIRCACHE_STAT;
+  }
+  if (!strcmp(value, "off")) {
+    return DIRCACHE_OFF;
+  }
+  return strcmp(value, "inotify") ? DIRCACHE_STAT : DIRCACHE_INOTIFY;
+}
+
+static struct dirslot *read_listing(const char *path, int mode) {
+  struct dirslot *slot = calloc(1, sizeof(struct dirslot));
+  if (slot == NULL) {
+    return NULL;
+  }
+  slot->wd = -1;
+  // Watch before reading, so nothing can change in between unseen
+  if (mode == DIRCACHE_INOTIFY) {
+    if (inotifyfd < 0) {
+      inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (inotifyfd >= 0) {
+      slot->wd = inotify_add_watch(inotifyfd, path, WATCH_EVENTS);
+    }
+  }
+  DIR *dir = opendir(path);
+  struct stat buf;
+  if (dir == NULL || fstat(dirfd(dir), &buf)) {
+    if (dir != NULL) {
+      closedir(dir);
+    }
+    free_slot(slot);
+    return NULL;
+  }
+  // The stamps of what was actually opened
+  slot->dev = buf.st_dev;
+  slot->ino = buf.st_ino;
+  slot->mtime = buf.st_mtim;
+  slot->ctime = buf.st_ctim;
+  size_t len = 0;
+  size_t size = NAMES_START;
+  int entries = ENTRIES_START;
+  slot->list.names = malloc(size);
+  slot->list.types = malloc(entries);
+  int ok = slot->list.names != NULL && slot->list.types != NULL;
+  struct dirent *entry;
+  while (ok && (entry = readdir(dir)) != NULL) {
+    char *name = entry->d_name;
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+      continue;
+    }
+    size_t namelen = strlen(name) + 1;
+    // Grow by doubling
+    if (len + namelen > size) {
+      while (len + namelen > size) {
+        size *= 2;
+      }
+      char *names = realloc(slot->list.names, size);
+      ok = names != NULL;
+      slot->list.names = ok ? names : slot->list.names;
+    }
+    if (ok && slot->list.count == entries) {
+      unsigned char *types = realloc(slot->list.types, entries * 2);
+      ok = types != NULL;
+      slot->list.types = ok ? types : slot->list.types;
+      entries *= 2;
+    }
+    if (ok) {
+      memcpy(&slot->list.names[len], name, namelen);
+      slot->list.types[slot->list.count++] = entry->d_type;
+      len += namelen;
+    }
+  }
+  closedir(dir);
+  slot->list.len = len;
+  if (!ok) {
+    fprintf(stderr, "Malloc of directory listing failed.\n");
+    free_slot(slot);
+    return NULL;
+  }
+  slot->list.cached = keep_listing(slot, path, mode);
+  return slot;
+}
+
+static int keep_listing(struct dirslot *slot, const char *path, int mode) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  // Changed within the last second, the stamps can't be trusted yet
+  double since = (now.tv_sec - slot->mtime.tv_sec) +
+                 (now.tv_nsec - slot->mtime.tv_nsec) / 1e9;
+  if (mode == DIRCACHE_OFF || (slot->wd < 0 && since < 1)) {
+    return 0;
+  }
+  // Shown from where it is, the working directory may change
+  char cwd[PATH_MAX];
+  if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) {
+    slot->path = strdup(path);
+  } else if (!strcmp(path, ".")) {
+    slot->path = strdup(cwd);
+  } else if ((slot->path = malloc(strlen(cwd) + strlen(path) + 2)) != NULL) {
+    sprintf(slot->path, "%s/%s", cwd, path);
+  }
+  if (slot->path == NULL) {
+    return 0;
+  }
+  if (nslots == DIRCACHE_MAX) {
+    // Make room by dropping the least recently used one
+    int oldest = 0;
+    for (int i = 1; i < nslots; i++) {
+      if (slots[i]->used < slots[oldest]->used) {
+        oldest = i;
+      }
+    }
+    drop_slot(oldest);
+  }
+  slot->used = ++uses;
+  slots[nslots++] = slot;
+  return 1;
+}
+
+static void drain_events(void) {
+  char events[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t chars;
+  if (inotifyfd < 0) {
+    return;
+  }
+  while ((chars = read(inotifyfd, events, sizeof(events))) > 0) {
+    for (char *p = events; p < events + chars;) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + event->len;
+      for (int i = 0; i < nslots; i++) {
+        if (slots[i]->wd == event->wd) {
+          drop_slot(i);
+          break;
+        }
+      }
+    }
+  }
+}
+
+static void drop_slot(int index) {
+  struct dirslot *slot = slots[index];
+  slots[index] = slots[--nslots];
+  slot->list.cached = 0;
+  if (slot->wd >= 0) {
+    inotify_rm_watch(inotifyfd, slot->wd);
+    slot->wd = -1;
+  }
+  // Still being read by someone, they free it when done
+  if (slot->list.users == 0) {
+    free_slot(slot);
+  }
+}
+
+static void free_slot(struct dirslot *slot) {
+  if (slot->wd >= 0) {
+    inotify_rm_watch(inotifyfd, slot->wd);
+  }
+  free(slot->list.names);
+  free(slot->list.types);
+  free(slot->path);
+  free(slot);
+}
@@ -4,8 +4,13 @@
  * Spring Quarter 2020
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,36 +21,103 @@
 #include "defn.h"
 
 // Constants
-#define NON_ENV_OVERFLOW 1
-#define PID_OVERFLOW 2
-#define MATCHING_ENV_OVERFLOW 3
-#define ENV_OVERFLOW 4
-#define MATCHING_CMD_OVERFLOW 5
-#define CMD_FORK_ERROR 6
-#define CMD_EXP_OVERFLOW 7
-#define ARGC_OVERFLOW 8
-#define ARGN_OVERFLOW 9
-#define LAST_EXIT_OVERFLOW 10
-#define WILD_OVERFLOW 11
+#define ALLOC_FAILURE 1
+#define MATCHING_ENV_OVERFLOW 2
+#define MATCHING_CMD_OVERFLOW 3
+#define CMD_FORK_ERROR 4
+#define GLOB_FAILURE 5
+#define CMD_START_SIZE 256
+#define CMD_READ_MIN 4096
+#define CMD_READ_SIZE 65536
+#define CMD_PIPE_SIZE 1048576
+
+#define SUBS_START 4
+#define LITERALS_START 8
+
+// A $(...) that has been started, its output is spliced in at the end
+struct substitution {
+  size_t at; // Where in the expanded line the output goes
+  struct buffer output;
+  int fd; // Pipe the output is still coming through, -1 once it's all in
+  int job; // From processline(), 0 once there's nothing left to wait on
+  int newline; // "Boolean" representing if the output ended with '\n'
+  int status; // Exit value once it has finished
+  char *key; // Memo key for a $(@...), NULL otherwise
+};
+// Every substitution started on one line
+struct substitutions {
+  struct substitution *subs;
+  int count;
+  int size;
+};
 
 // Prototypes
 void print_error(int error_type);
+int expand_sites(char *orig, struct lineir *ir, struct buffer *new,
+                 struct substitutions *subs);
+int start_substitution(char *cmd, size_t at, struct substitutions *subs);
+int collect_substitutions(struct substitutions *subs);
+int read_substitution(struct substitution *sub);
+int splice_substitutions(struct buffer *new, struct substitutions *subs);
+int append_unescaped(struct buffer *new, const char *str, size_t len);
+int mark_literal(struct buffer *buf, size_t from);
+void finish_substitution(struct substitution *sub);
+void wait_substitution(int job);
+
+/*
+ * Every $(...) on the line runs to the end before expansion carries on, left
+ * to right, so one can see what an earlier one did. With set -o
+ * concurrentsubs they are only started as they are found and expansion
+ * carries on around them, so they all run at once. Either way their outputs
+ * are spliced into place once the rest of the line is done.
+ */
+int expand(char *orig, struct lineir *ir, struct buffer *new) {
+  struct substitutions subs = {NULL, 0, 0};
+  int ok = expand_sites(orig, ir, new, &subs);
+  if (subs.count == 0) {
+    return ok;
+  }
+  if (ok) {
+    TRACE_BEGIN("collect", NULL);
+    ok = collect_substitutions(&subs);
+    TRACE_END("collect");
+  }
+  if (!ok) {
+    // Don't leave anything running behind
+    for (int k = 0; k < subs.count; k++) {
+      finish_substitution(&subs.subs[k]);
+    }
+    return 0;
+  }
+  if (!splice_substitutions(new, &subs)) {
+    print_error(ALLOC_FAILURE);
+    return 0;
+  }
+  return 1;
+}
 
-int expand(char *orig, char *new, int newsize) {
-  // "Pointer" for current position in new
-  int ptr = 0;
+int expand_sites(char *orig, struct lineir *ir, struct buffer *new,
+                 struct substitutions *subs) {
+  size_t len = ir != NULL ? ir->len : strlen(orig);
+  int site = 0; // Next entry of ir->sites that hasn't been passed yet
+  size_t *literals = NULL; // Where escaped wildcards were put in new, or
+                           // the '\' still in front of them
+  int nliterals = 0;
+  int literals_size = 0;
+  if (!buffer_init(new, len + 1)) {
+    print_error(ALLOC_FAILURE);
+    return 0;
+  }
   for (int i = 0; orig[i] != 0; i++) {
     // Check if any environment variables are possible
     if (orig[i] == '$') {
       i++;
       if (orig[i] == '$') {
         // Attempt to expand PID
-        int chars = snprintf(&new[ptr], newsize - ptr, "%d", getpid());
-        if (chars > newsize - ptr) {
-          print_error(PID_OVERFLOW);
+        if (!buffer_printf(new, "%d", getpid())) {
+          print_error(ALLOC_FAILURE);
           return 0;
         }
-        ptr += chars;
       } else if (orig[i] == '{') {
         // Try to parse an environment variable
         i++;
@@ -62,12 +134,11 @@ int expand(char *orig, char *new, int newsize) {
         char *value = getenv(var_name);
         if (value != NULL) {
           // Attempt to expand environment variable
-          int chars = snprintf(&new[ptr], newsize - ptr, "%s", value);
-          if (chars > newsize - ptr) {
-            print_error(ENV_OVERFLOW);
+          size_t from = new->len;
+          if (!buffer_printf(new, "%s", value) || !mark_literal(new, from)) {
+            print_error(ALLOC_FAILURE);
             return 0;
           }
-          ptr += chars;
         }
         // Clean up after ourselves
         orig[i] = '}';
@@ -89,86 +160,12 @@ int expand(char *orig, char *new, int newsize) {
         }
         // Use cmp_exp as a substring
         orig[i - 1] = 0;
-        // Create a new pipe
-        int pipefd[2];
-        if (pipe(pipefd)) {
-          perror("pipe");
-          return 0;
-        }
-        // Call processline using cmd_exp as buffer and pipe as outfd
-        int cpid = processline(cmd_exp, 0, pipefd[1], NOWAIT | EXPAND);
-        if (cpid < 0) {
-          print_error(CMD_FORK_ERROR);
-          if (close(pipefd[0])) {
-            perror("close");
-          }
-          if (close(pipefd[1])) {
-            perror("close");
-          }
-          return 0;
-        }
-        // No writing is done on this end
-        if (close(pipefd[1])) {
-          perror("close");
-          return 0;
-        }
-        // Read from pipe
-        int tmp_ptr = ptr; // Save current pointer for later
-        int chars = -1;
-        while (chars != 0) {
-          if (sigint_caught) {
-            if (close(pipefd[0])) {
-              perror("close");
-            }
-            return 0;
-          }
-          chars = read(pipefd[0], &new[ptr], newsize - ptr);
-          if (chars < 0) {
-            perror("read");
-            if (close(pipefd[0])) {
-              perror("close");
-            }
-            return 0;
-          }
-          if (chars >= newsize - ptr) {
-            print_error(CMD_EXP_OVERFLOW);
-            if (close(pipefd[0])) {
-              perror("close");
-            }
-            return 0;
-          }
-          ptr += chars;
-        }
-        // Remove ending newline
-        if (new[ptr - 1] == '\n') {
-          ptr--;
-        }
-        // Replace all other newlines with spaces
-        while (tmp_ptr < ptr) {
-          if (new[tmp_ptr] == '\n') {
-            new[tmp_ptr] = ' ';
-          }
-          tmp_ptr++;
-        }
-        // Close read end of pipe
-        if (close(pipefd[0])) {
-          perror("close");
+        TRACE_BEGIN("substitution", cmd_exp);
+        int started = start_substitution(cmd_exp, new->len, subs);
+        TRACE_END("substitution");
+        if (!started) {
           return 0;
         }
-        // Wait on child if one was created
-        if (cpid > 0) {
-          waiting_on = cpid;
-          int status;
-          if (waitpid(cpid, &status, 0) < 0) {
-            perror("waitpid");
-          } else {
-            waiting_on = 0;
-            // Update last exit global value
-            if (WIFEXITED(status)) {
-              last_exit = WEXITSTATUS(status);
-            }
-          }
-        }
         // Clean up after ourselves
         i--;
         orig[i] = ')';
@@ -181,12 +178,10 @@ int expand(char *orig, char *new, int newsize) {
           argc--;
         }
         // Attempt to expand number of arguments
-        int chars = snprintf(&new[ptr], newsize - ptr, "%d", argc);
-        if (chars > newsize - ptr) {
-          print_error(ARGC_OVERFLOW);
+        if (!buffer_printf(new, "%d", argc)) {
+          print_error(ALLOC_FAILURE);
           return 0;
         }
-        ptr += chars;
       } else if (isdigit(orig[i])) {
         int minarg = 0;
         int argnumber = atoi(&orig[i]);
@@ -200,24 +195,24 @@ int expand(char *orig, char *new, int newsize) {
           // Base case (script name)
           char *argument = mainargv[argnumber];
           // Attempt to expand base argument (script name)
-          int chars = snprintf(&new[ptr], newsize - ptr, "%s", argument);
-          if (chars > newsize - ptr) {
-            print_error(ARGN_OVERFLOW);
+          size_t from = new->len;
+          if (!buffer_printf(new, "%s", argument) ||
+              !mark_literal(new, from)) {
+            print_error(ALLOC_FAILURE);
             return 0;
           }
-          ptr += chars;
         } else {
           // Apply shift offset
           argnumber += cur_shift;
           if (argnumber >= minarg && argnumber < mainargc) {
             // If argnumber is within bounds, attempt to expand it
             char *argument = mainargv[argnumber];
-            int chars = snprintf(&new[ptr], newsize - ptr, "%s", argument);
-            if (chars > newsize - ptr) {
-              print_error(ARGN_OVERFLOW);
+            size_t from = new->len;
+            if (!buffer_printf(new, "%s", argument) ||
+                !mark_literal(new, from)) {
+              print_error(ALLOC_FAILURE);
               return 0;
             }
-            ptr += chars;
           }
         }
         // Skip remaining original argument
@@ -227,158 +222,441 @@ int expand(char *orig, char *new, int newsize) {
         // Step back one to prevent overwriting next character
         i--;
       } else if (orig[i] == '?') {
+        // A $(...) before it has to finish first, it's that one's exit value
+        if (subs->count > 0) {
+          TRACE_BEGIN("collect", NULL);
+          int collected = collect_substitutions(subs);
+          TRACE_END("collect");
+          if (!collected) {
+            return 0;
+          }
+          last_exit = subs->subs[subs->count - 1].status;
+        }
         // Attempt to expand last command exit value
-        int chars = snprintf(&new[ptr], newsize - ptr, "%d", last_exit);
-        if (chars > newsize - ptr) {
-          print_error(LAST_EXIT_OVERFLOW);
+        if (!buffer_printf(new, "%d", last_exit)) {
+          print_error(ALLOC_FAILURE);
           return 0;
         }
-        ptr += chars;
       } else {
         // We got ahead of ourselves
         // Back it up and copy the $
         i--;
-        new[ptr] = orig[i];
-        ptr++;
+        if (!buffer_append(new, &orig[i], 1)) {
+          print_error(ALLOC_FAILURE);
+          return 0;
+        }
+      }
+    } else if ((orig[i] == '*' || orig[i] == '?' || orig[i] == '[') &&
+               (i == 0 || orig[i - 1] != '\\')) {
+      // Wildcard found, the part of its word before it is already in new
+      size_t floor = subs->count > 0 ? subs->subs[subs->count - 1].at : 0;
+      size_t start = new->len;
+      while (start > floor && new->data[start - 1] != ' ' &&
+             new->data[start - 1] != '"') {
+        start--;
+      }
+      size_t end = i;
+      while (orig[end] != 0 && orig[end] != ' ' && orig[end] != '"') {
+        end++;
       }
-    } else if (orig[i] == '*' && (orig[i - 1] == ' ' || orig[i - 1] == '"')) {
-      // Valid wildcard found, attempt to open the current directory
-      DIR *cur_dir = opendir(".");
-      if (cur_dir == NULL) {
-        perror("opendir");
+      // The pattern is the whole word, with the escapes already taken out
+      // of the part before it put back
+      int first = nliterals;
+      while (first > 0 && literals[first - 1] >= start) {
+        first--;
+      }
+      size_t prefix = new->len - start + nliterals - first;
+      char *pattern = arena_alloc(prefix + end - i + 1);
+      if (pattern == NULL) {
+        print_error(ALLOC_FAILURE);
         return 0;
       }
-      struct dirent *direntry;
-      int entries_found = 0;
-      if (orig[i + 1] == ' ' || orig[i + 1] == '"' || orig[i + 1] == 0) {
-        // Default *
-        while ((direntry = readdir(cur_dir))) {
-          // Find all valid entry names (doesn't start with '.')
-          char *entname = direntry->d_name;
-          if (entname[0] != '.') {
-            entries_found++;
-            // Attempt to expand entry name
-            int chars = snprintf(&new[ptr], newsize - ptr, "%s ", entname);
-            if (chars > newsize - ptr) {
-              print_error(WILD_OVERFLOW);
-              return 0;
-            }
-            ptr += chars;
+      size_t p = 0;
+      for (size_t k = start; k < new->len; k++) {
+        if (first < nliterals && literals[first] == k) {
+          // A '\' that is still there is copied as it is
+          if (new->data[k] != '\\') {
+            pattern[p++] = '\\';
           }
+          first++;
         }
-      } else {
-        // Pattern matching *
-        int pat_chrs = 0;
-        while (orig[i + pat_chrs + 1] != 0) {
-          if (orig[i + pat_chrs + 1] != ' ' && orig[i + pat_chrs + 1] != '"') {
-            // Find end of pattern, throw error and return if a '/' is found
-            if (orig[i + pat_chrs + 1] == '/') {
-              fprintf(stderr, "Wildcard pattern cannot contain '/'.\n");
-              return 0;
-            }
-            pat_chrs++;
-          } else {
-            break;
-          }
+        // Markers for the lexer mean nothing to the matcher
+        if (new->data[k] != LEX_LITERAL) {
+          pattern[p++] = new->data[k];
         }
-        // Declare and initialize pattern array
-        char pattern[pat_chrs];
-        for (int j = 0; j < pat_chrs; j++) {
-          pattern[j] = orig[i + j + 1];
+      }
+      prefix = p;
+      memcpy(&pattern[prefix], &orig[i], end - i);
+      pattern[prefix + end - i] = 0;
+      // Words still holding something to expand are left alone
+      if (!glob_pattern(pattern) || memchr(&orig[i], '$', end - i) != NULL) {
+        if (!buffer_append(new, &orig[i], 1)) {
+          print_error(ALLOC_FAILURE);
+          return 0;
         }
-        while ((direntry = readdir(cur_dir))) {
-          // Find all valid entry names (doesn't start with '.')
-          char *entname = direntry->d_name;
-          if (entname[0] != '.') {
-            // Check if pattern matches
-            int pattern_pos = strlen(entname) - pat_chrs;
-            if (!strncmp(&entname[pattern_pos], pattern, pat_chrs)) {
-              entries_found++;
-              // Attempt to expand entry name
-              int chars = snprintf(&new[ptr], newsize - ptr, "%s ", entname);
-              if (chars > newsize - ptr) {
-                print_error(WILD_OVERFLOW);
-                return 0;
-              }
-              ptr += chars;
+        continue;
+      }
+      TRACE_BEGIN("glob", pattern);
+      size_t oldlen = new->len;
+      int oldliterals = nliterals;
+      new->len = start;
+      while (nliterals > 0 && literals[nliterals - 1] >= start) {
+        nliterals--;
+      }
+      int found = glob_expand(pattern, new);
+      TRACE_END("glob");
+      if (found < 0) {
+        print_error(found == -2 ? GLOB_FAILURE : ALLOC_FAILURE);
+        return 0;
+      }
+      // Names are only ever arguments
+      if (found > 0 && !mark_literal(new, start)) {
+        print_error(ALLOC_FAILURE);
+        return 0;
+      }
+      // If nothing matched, the word stays as it was, less its escapes, so
+      // what came before the wildcard loses any '\' it still has
+      if (found == 0) {
+        int l = nliterals;
+        new->len = start;
+        for (size_t k = start; k < oldlen; k++) {
+          if (l < oldliterals && literals[l] == k) {
+            l++;
+            if (new->data[k] == '\\') {
+              continue;
             }
           }
-        }
-        if (entries_found) {
-          i += pat_chrs;
-        } else {
-          // If no entries were found, simply print the '*' and continue
-          new[ptr] = '*';
-          ptr++;
+          new->data[new->len++] = new->data[k];
         }
       }
-      // Remove last trailing space character if any valid entries were found
-      if (entries_found) {
-        ptr--;
+      if (found == 0 && !append_unescaped(new, &orig[i], end - i)) {
+        print_error(ALLOC_FAILURE);
+        return 0;
+      }
+      i = end - 1;
+    } else if (orig[i] == '*' || orig[i] == '?' || orig[i] == '[') {
+      // Escape sequence, a '\*' is just the '*', while '\?' and '\[' keep
+      // their '\' unless the word turns out to be a pattern
+      if (orig[i] == '*') {
+        new->data[new->len - 1] = orig[i];
+      } else if (!buffer_append(new, &orig[i], 1)) {
+        print_error(ALLOC_FAILURE);
+        return 0;
       }
-      // Attempt to close current directory
-      if (closedir(cur_dir)) {
-        perror("closedir");
+      // Either way remember it, in case it does
+      if (nliterals == literals_size) {
+        int size = literals_size ? literals_size * 2 : LITERALS_START;
+        literals = arena_grow(literals, sizeof(size_t) * literals_size,
+                              sizeof(size_t) * size);
+        if (literals == NULL) {
+          print_error(ALLOC_FAILURE);
+          return 0;
+        }
+        literals_size = size;
       }
-    } else if (orig[i] == '*' && orig[i - 1] == '\\') {
-      // Escape sequence '\*', just print '*'
-      new[ptr - 1] = '*';
+      literals[nliterals++] = new->len - (orig[i] == '*' ? 1 : 2);
     } else {
-      // Business as usual, copy the character
-      if (ptr < newsize) {
-        new[ptr] = orig[i];
-        ptr++;
+      // Business as usual, copy everything up to the next '$' or wildcard
+      size_t end;
+      if (ir != NULL) {
+        // The lexer already knows where that is
+        while (site < ir->nsites && ir->sites[site] <= i) {
+          site++;
+        }
+        end = site < ir->nsites ? ir->sites[site] : len;
       } else {
-        print_error(NON_ENV_OVERFLOW);
+        end = lex_scan(orig, i + 1, "$*?[");
+      }
+      if (!buffer_append(new, &orig[i], end - i)) {
+        print_error(ALLOC_FAILURE);
         return 0;
       }
+      i = end - 1;
     }
   }
   // Place a 0 at the end to prevent old remnants from leaking out
-  if (ptr < newsize) {
-    new[ptr] = 0;
-  } else {
-    print_error(NON_ENV_OVERFLOW);
-    return 0;
-  }
+  new->data[new->len] = 0;
   return 1;
 }
 
 void print_error(int error_type) {
   switch (error_type) {
-    case NON_ENV_OVERFLOW:
-      fprintf(stderr, "Non-env expansion overflowed. ");
-      break;
-    case PID_OVERFLOW:
-      fprintf(stderr, "PID expansion overflowed. ");
+    case ALLOC_FAILURE:
+      fprintf(stderr, "Allocation during expansion failed. ");
       break;
     case MATCHING_ENV_OVERFLOW:
       fprintf(stderr, "Reached end of line before finding matching '}'. ");
       break;
-    case ENV_OVERFLOW:
-      fprintf(stderr, "Environment variable expansion overflowed. ");
-      break;
     case MATCHING_CMD_OVERFLOW:
       fprintf(stderr, "Reached end of line before finding matching ')'. ");
       break;
     case CMD_FORK_ERROR:
       fprintf(stderr, "Fork during command expansion failed. ");
       break;
-    case CMD_EXP_OVERFLOW:
-      fprintf(stderr, "Command expansion overflowed. ");
-      break;
-    case ARGC_OVERFLOW:
-      fprintf(stderr, "Argument count expansion overflowed. ");
-      break;
-    case ARGN_OVERFLOW:
-      fprintf(stderr, "Argument expansion overflowed. ");
-      break;
-    case LAST_EXIT_OVERFLOW:
-      fprintf(stderr, "Last exit value expansion overflowed. ");
-      break;
-    case WILD_OVERFLOW:
-      fprintf(stderr, "Wildcard expansion overflowed. ");
+    case GLOB_FAILURE:
+      fprintf(stderr, "Wildcard expansion failed. ");
       break;
   }
   fprintf(stderr, "Line processing halted.\n");
 }
+
+int start_substitution(char *cmd, size_t at, struct substitutions *subs) {
+  // Make room for one more
+  if (subs->count == subs->size) {
+    int size = subs->size ? subs->size * 2 : SUBS_START;
+    subs->subs = arena_grow(subs->subs,
+                            sizeof(struct substitution) * subs->size,
+                            sizeof(struct substitution) * size);
+    if (subs->subs == NULL) {
+      print_error(ALLOC_FAILURE);
+      return 0;
+    }
+    subs->size = size;
+  }
+  struct substitution *sub = &subs->subs[subs->count];
+  int flags = NOWAIT | EXPAND | CAPTURE;
+  sub->at = at;
+  sub->fd = -1;
+  sub->job = 0;
+  sub->newline = 0;
+  sub->key = NULL;
+  if (!buffer_init(&sub->output, CMD_START_SIZE)) {
+    print_error(ALLOC_FAILURE);
+    return 0;
+  }
+  if (cmd[0] == '@') {
+    // Memoized, expand it first so the key holds what would really run
+    struct lineir ir;
+    struct buffer expanded;
+    cmd++;
+    if (!lex_compile(cmd, &ir)) {
+      print_error(ALLOC_FAILURE);
+      return 0;
+    }
+    if (ir.flags & LEX_EXPAND) {
+      if (!expand(cmd, &ir, &expanded)) {
+        return 0;
+      }
+      cmd = expanded.data;
+    }
+    if ((sub->key = memo_key(cmd)) == NULL) {
+      print_error(ALLOC_FAILURE);
+      return 0;
+    }
+    if (memo_get(sub->key, &sub->output)) {
+      // Only successful output is kept, nothing to run or store again
+      sub->key = NULL;
+      sub->status = 0;
+      last_exit = 0;
+      subs->count++;
+      return 1;
+    }
+    flags = NOWAIT | NOEXPAND | CAPTURE;
+  }
+  struct capture *outer = capture;
+  struct capture output = {&sub->output, -1, 0};
+  // Builtins write straight into the output, anything else leaves a pipe
+  capture = &output;
+  int job = processline(cmd, 0, -1, flags);
+  capture = outer;
+  if (job < 0) {
+    print_error(CMD_FORK_ERROR);
+    return 0;
+  }
+  sub->fd = output.fd;
+  sub->job = job;
+  sub->newline = output.newline;
+  sub->status = last_exit;
+  subs->count++;
+  // A $(@...) always finishes here, so the same one later on the line
+  // finds what it produced
+  if (!concurrent_subs || sub->key != NULL) {
+    TRACE_BEGIN("collect", NULL);
+    int collected = collect_substitutions(subs);
+    TRACE_END("collect");
+    if (!collected) {
+      return 0;
+    }
+  }
+  // Keep what $(@...) produced for next time, if it succeeded
+  if (sub->key != NULL && sub->status == 0) {
+    memo_put(sub->key, sub->output.data, sub->output.len - sub->newline);
+  }
+  return 1;
+}
+
+int collect_substitutions(struct substitutions *subs) {
+  struct pollfd *fds = arena_alloc(sizeof(struct pollfd) * subs->count);
+  int *which = arena_alloc(sizeof(int) * subs->count);
+  if (fds == NULL || which == NULL) {
+    print_error(ALLOC_FAILURE);
+    return 0;
+  }
+  while (1) {
+    // Watch every pipe that hasn't reached its end yet
+    int n = 0;
+    for (int k = 0; k < subs->count; k++) {
+      if (subs->subs[k].fd >= 0) {
+        fds[n].fd = subs->subs[k].fd;
+        fds[n].events = POLLIN;
+        which[n++] = k;
+      }
+    }
+    if (n == 0) {
+      return 1;
+    }
+    if (sigint_caught) {
+      return 0;
+    }
+    if (poll(fds, n, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return 0;
+    }
+    for (int j = 0; j < n; j++) {
+      if (fds[j].revents == 0) {
+        continue;
+      }
+      struct substitution *sub = &subs->subs[which[j]];
+      int chars = read_substitution(sub);
+      if (chars < 0) {
+        return 0;
+      }
+      if (chars == 0) {
+        // All of it is in, collect the job
+        finish_substitution(sub);
+      }
+    }
+  }
+}
+
+int read_substitution(struct substitution *sub) {
+  struct buffer *out = &sub->output;
+  // Straight into the output, in ever bigger pieces as it grows
+  size_t want = out->len < CMD_READ_MIN ? CMD_READ_MIN :
+                out->len < CMD_READ_SIZE ? out->len : CMD_READ_SIZE;
+  if (!buffer_reserve(out, want)) {
+    print_error(ALLOC_FAILURE);
+    return -1;
+  }
+  int chars = read(sub->fd, &out->data[out->len], out->size - out->len - 1);
+  if (chars < 0) {
+    perror("read");
+    return -1;
+  }
+  if (chars > 0) {
+    // Newlines become spaces while the bytes are still in cache
+    sub->newline = out->data[out->len + chars - 1] == '\n';
+    lex_unline(&out->data[out->len], chars);
+    if (out->len < CMD_READ_SIZE && out->len + chars >= CMD_READ_SIZE) {
+      // A pipe's worth and still going, let the writer get further ahead
+      fcntl(sub->fd, F_SETPIPE_SZ, CMD_PIPE_SIZE);
+    }
+    out->len += chars;
+  }
+  return chars;
+}
+
+int splice_substitutions(struct buffer *new, struct substitutions *subs) {
+  struct buffer joined;
+  size_t total = new->len;
+  for (int k = 0; k < subs->count; k++) {
+    total += subs->subs[k].output.len;
+  }
+  if (!buffer_init(&joined, total + 1)) {
+    return 0;
+  }
+  // Everything between substitutions, then each one less its last newline
+  size_t from = 0;
+  for (int k = 0; k < subs->count; k++) {
+    struct substitution *sub = &subs->subs[k];
+    if (!buffer_append(&joined, &new->data[from], sub->at - from)) {
+      return 0;
+    }
+    size_t start = joined.len;
+    if (!buffer_append(&joined, sub->output.data,
+                       sub->output.len - sub->newline) ||
+        !mark_literal(&joined, start)) {
+      return 0;
+    }
+    from = sub->at;
+  }
+  if (!buffer_append(&joined, &new->data[from], new->len - from)) {
+    return 0;
+  }
+  *new = joined;
+  return 1;
+}
+
+// Append str without the '\\' in front of any wildcard
+int append_unescaped(struct buffer *new, const char *str, size_t len) {
+  if (!buffer_reserve(new, len)) {
+    return 0;
+  }
+  for (size_t k = 0; k < len; k++) {
+    if (str[k] == '\\' && k + 1 < len &&
+        (str[k + 1] == '*' || str[k + 1] == '?' || str[k + 1] == '[')) {
+      k++;
+    }
+    new->data[new->len++] = str[k];
+  }
+  return 1;
+}
+
+/*
+ * Put a LEX_LITERAL in front of each '<', '>' and '&' from buf->data[from]
+ * on, so what an expansion produced is never taken for a redirection or a
+ * background job. Returns 0 if there was no room for them.
+ */
+int mark_literal(struct buffer *buf, size_t from) {
+  size_t n = 0;
+  for (size_t k = from; k < buf->len; k++) {
+    n += buf->data[k] == '<' || buf->data[k] == '>' || buf->data[k] == '&';
+  }
+  if (n == 0) {
+    return 1;
+  }
+  if (!buffer_reserve(buf, n)) {
+    return 0;
+  }
+  // From the end back, each byte moves up by the markers still before it
+  size_t r = buf->len;
+  buf->len += n;
+  buf->data[buf->len] = 0;
+  for (size_t w = buf->len; n > 0;) {
+    char c = buf->data[--r];
+    buf->data[--w] = c;
+    if (c == '<' || c == '>' || c == '&') {
+      buf->data[--w] = LEX_LITERAL;
+      n--;
+    }
+  }
+  return 1;
+}
+
+void finish_substitution(struct substitution *sub) {
+  // Close read end of pipe
+  if (sub->fd >= 0 && close(sub->fd)) {
+    perror("close");
+  }
+  sub->fd = -1;
+  if (sub->job > 0) {
+    wait_substitution(sub->job);
+    sub->status = last_exit;
+  }
+  sub->job = 0;
+}
+
+void wait_substitution(int job) {
+  // Wait on the job if one was started
+  if (job > 0) {
+    int status;
+    if (job_wait(job - 1, &status) > 0) {
+      // Update last exit global value
+      last_exit = report_status(status, -1);
+    }
+    job_free(job - 1);
+  }
+}
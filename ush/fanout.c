@@ -0,0 +1,216 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Fan-out for "producer |+ consumer |+ consumer ...": every consumer after
+ * a run of |+ reads its own copy of what the producer writes. A child of
+ * the shell pumps the producer's pipe into one pipe per consumer with
+ * tee(), which only adds references to the pages already in the pipe, so
+ * the data never passes through user space.
+ *
+ * tee() always copies from the front of its input, so the pump keeps track
+ * of how far past the front each consumer already is. Only those with
+ * nothing past it are fed, and they only up to the one furthest ahead; once
+ * every consumer has a stretch it is dropped by splicing it into /dev/null.
+ * The slowest consumer sets the pace and nothing is buffered beyond what
+ * the pipes hold. A consumer that exits early is left out from then on.
+ */
+
+// Constants
+#define FANOUT_PIPE_SIZE 1048576
+#define TEE_CHUNK 1048576 // Most one call is asked to duplicate
+
+// Prototypes
+static void keep_only(int *fds, int n);
+static int pump(int infd, int *outfds, int n);
+static int discard(int infd, int nullfd, size_t len);
+
+/*
+ * Start a pump copying infd to n new pipes, whose read ends go in readfds.
+ * pgid is as for spawn_command(). Returns the pump's pid, or -1 on failure.
+ */
+pid_t fanout(int infd, int *readfds, int n, pid_t pgid) {
+  int writefds[n + 1];
+  int pipefd[2];
+  int made;
+  for (made = 0; made < n; made++) {
+    // Close on exec, so no consumer holds another's pipe open
+    if (pipe2(pipefd, O_CLOEXEC)) {
+      perror("pipe");
+      break;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+    readfds[made] = pipefd[0];
+    writefds[made] = pipefd[1];
+  }
+  // The producer's side too, or it only ever moves a page at a time
+  fcntl(infd, F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+  pid_t cpid = made == n ? fork() : -1;
+  if (made == n && cpid < 0) {
+    perror("fork");
+  }
+  if (cpid == 0) {
+    // Killed by ^C like any other stage, and told about readers leaving
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    if (pgid >= 0) {
+      setpgid(0, pgid);
+    }
+    writefds[n] = infd;
+    keep_only(writefds, n + 1);
+    _exit(pump(infd, writefds, n));
+  }
+  if (cpid > 0 && pgid >= 0) {
+    // Both sides set it, whichever runs first
+    setpgid(cpid, pgid > 0 ? pgid : cpid);
+  }
+  for (int k = 0; k < made; k++) {
+    close(writefds[k]);
+    if (cpid < 0) {
+      close(readfds[k]);
+    }
+  }
+  return cpid;
+}
+
+// Close every descriptor above 2 not in fds
+static void keep_only(int *fds, int n) {
+  int sorted[n];
+  memcpy(sorted, fds, sizeof(int) * n);
+  for (int i = 1; i < n; i++) {
+    for (int k = i; k > 0 && sorted[k - 1] > sorted[k]; k--) {
+      int fd = sorted[k];
+      sorted[k] = sorted[k - 1];
+      sorted[k - 1] = fd;
+    }
+  }
+  unsigned int from = 3;
+  for (int i = 0; i < n; i++) {
+    if (sorted[i] > (int) from) {
+      close_range(from, sorted[i] - 1, 0);
+    }
+    if (sorted[i] >= (int) from) {
+      from = sorted[i] + 1;
+    }
+  }
+  close_range(from, ~0U, 0);
+}
+
+/*
+ * Feed infd to every one of outfds until it runs out or nobody is left to
+ * read. Returns the pump's exit value.
+ */
+static int pump(int infd, int *outfds, int n) {
+  size_t ahead[n]; // How far past the front of infd each one has been fed
+  int live[n]; // "Boolean" representing if anyone still reads it
+  struct pollfd pfds[n];
+  int nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (nullfd < 0) {
+    perror("open");
+    return 1;
+  }
+  for (int k = 0; k < n; k++) {
+    ahead[k] = 0;
+    live[k] = 1;
+  }
+  while (1) {
+    // Find the slowest and the fastest
+    size_t lo = 0;
+    size_t hi = 0;
+    int nlive = 0;
+    for (int k = 0; k < n; k++) {
+      if (live[k]) {
+        lo = nlive == 0 || ahead[k] < lo ? ahead[k] : lo;
+        hi = ahead[k] > hi ? ahead[k] : hi;
+        nlive++;
+      }
+    }
+    if (nlive == 0) {
+      return 0;
+    }
+    if (lo > 0) {
+      // Everyone has it, let it go
+      if (!discard(infd, nullfd, lo)) {
+        return 1;
+      }
+      for (int k = 0; k < n; k++) {
+        ahead[k] -= live[k] ? lo : 0;
+      }
+      continue;
+    }
+    // Bring the ones at the front up to the leader, or all on by a chunk
+    int moved = 0;
+    int npoll = 0;
+    for (int k = 0; k < n; k++) {
+      if (!live[k] || ahead[k] > 0) {
+        continue;
+      }
+      ssize_t chars = tee(infd, outfds[k], hi > 0 ? hi : TEE_CHUNK,
+                          SPLICE_F_NONBLOCK);
+      if (chars > 0) {
+        ahead[k] = chars;
+        moved = 1;
+      } else if (chars == 0) {
+        // Nothing left and nobody left to write any more
+        return 0;
+      } else if (errno == EPIPE) {
+        live[k] = 0;
+        close(outfds[k]);
+        moved = 1;
+      } else if (errno == EAGAIN) {
+        pfds[npoll].fd = outfds[k];
+        pfds[npoll].events = POLLOUT;
+        npoll++;
+      } else if (errno != EINTR) {
+        perror("tee");
+        return 1;
+      }
+    }
+    if (moved || npoll == 0) {
+      continue;
+    }
+    // An empty input is waited on by itself, or the writable outputs would
+    // wake us straight away
+    int queued = 0;
+    if (hi == 0 && (ioctl(infd, FIONREAD, &queued) || queued == 0)) {
+      pfds[0].fd = infd;
+      pfds[0].events = POLLIN;
+      npoll = 1;
+    }
+    if (poll(pfds, npoll, -1) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+  }
+}
+
+// Drop the first len bytes of infd
+static int discard(int infd, int nullfd, size_t len) {
+  while (len > 0) {
+    ssize_t chars = splice(infd, NULL, nullfd, NULL, len, 0);
+    if (chars == 0 || (chars < 0 && errno != EINTR)) {
+      perror("splice");
+      return 0;
+    }
+    len -= chars > 0 ? chars : 0;
+  }
+  return 1;
+}
@@ -0,0 +1,456 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Wildcard expansion. A pattern is split at each '/' and every component
+ * with a wildcard in it is compiled once into a list of tokens: literal
+ * bytes, '?', '*' and [...] classes (with '!' or '^' to negate and a-z
+ * ranges). Matching never backs up further than the last '*', so it stays
+ * linear in practice however many stars there are.
+ *
+ * Directories are only read for components with wildcards, literal ones
+ * are appended as they are, and their listings come from dircache.c. d_type
+ * saves a stat() on every entry except symlinks and file systems that don't
+ * fill it in. Matches are collected in one arena block and sorted before
+ * they are written out, separated by spaces. Names starting with '.' only
+ * match a component that does too.
+ *
+ * A component that is exactly ** matches any number of directories, none
+ * included, and is handed to the parallel walker in walk.c. USH_GLOB_MAX
+ * caps how many names one pattern can match (the line fails past it) and
+ * USH_GLOB_DEPTH how many directories deep ** goes.
+ */
+
+// Token types
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1
+#define GLOB_STAR 2
+#define GLOB_CLASS 3
+
+// Constants
+#define MATCHES_START 64
+#define DEFAULT_GLOB_MAX 1000000
+#define DEFAULT_GLOB_DEPTH 128
+
+struct globtok {
+  int type;
+  unsigned char c;
+  unsigned char set[32]; // Bitmap of the bytes a GLOB_CLASS accepts
+};
+
+// One '/' separated piece of the pattern
+struct component {
+  char *text; // With escapes removed if it is literal
+  int literal; // "Boolean" representing if it has no wildcards
+  int recursive; // "Boolean" representing if it is **
+  struct globtok *toks;
+  int ntoks;
+};
+
+struct globber {
+  struct component *comps;
+  int ncomps;
+  int dirs_only; // Pattern ended with '/'
+  long max_matches;
+  int max_depth;
+  int reported; // "Boolean" representing if a failure was already printed
+  char path[PATH_MAX]; // Directory being read, ends with '/' unless empty
+  struct buffer names; // Every match, each one 0 terminated
+  size_t *offsets;
+  int count;
+  int size;
+};
+
+// Prototypes
+static int compile(struct component *comp, char *text);
+static int parse_class(const char *p, struct globtok *tok);
+static int match(struct globtok *toks, int ntoks, const char *name);
+static int walk(struct globber *g, size_t pathlen, int comp);
+static int walk_tree(struct globber *g, size_t pathlen, int comp);
+static int match_component(void *arg, const char *name);
+static long glob_limit(const char *name, long fallback);
+static int is_dir(struct globber *g, size_t pathlen, const char *name,
+                  unsigned char type);
+static int add_match(struct globber *g, size_t pathlen, const char *name,
+                     int slash);
+static int compare_names(const void *a, const void *b);
+
+int glob_pattern(const char *word) {
+  // '\' keeps the next character from counting
+  for (const char *p = word; *p != 0; p++) {
+    if (*p == '\\' && p[1] != 0) {
+      p++;
+    } else if (*p == '*' || *p == '?') {
+      return 1;
+    } else if (*p == '[') {
+      struct globtok tok;
+      if (parse_class(p, &tok) > 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int glob_expand(const char *pattern, struct buffer *out) {
+  struct globber g;
+  size_t pathlen = 0;
+  size_t patlen = strlen(pattern);
+  char *copy = arena_alloc(patlen + 1);
+  if (copy == NULL) {
+    return -1;
+  }
+  memcpy(copy, pattern, patlen + 1);
+  // An absolute pattern starts reading from the root
+  if (copy[0] == '/') {
+    g.path[pathlen++] = '/';
+  }
+  g.dirs_only = patlen > 0 && copy[patlen - 1] == '/';
+  g.max_matches = glob_limit("USH_GLOB_MAX", DEFAULT_GLOB_MAX);
+  g.max_depth = glob_limit("USH_GLOB_DEPTH", DEFAULT_GLOB_DEPTH);
+  // One component per '/', empty ones from "//" don't count
+  g.ncomps = 0;
+  for (size_t i = 0; i < patlen; i++) {
+    g.ncomps += copy[i] != '/' && (i == 0 || copy[i - 1] == '/');
+  }
+  g.comps = arena_alloc(sizeof(struct component) * (g.ncomps + 1));
+  if (g.comps == NULL) {
+    return -1;
+  }
+  int n = 0;
+  for (char *text = strtok(copy, "/"); text != NULL;
+       text = strtok(NULL, "/")) {
+    if (!compile(&g.comps[n++], text)) {
+      return -1;
+    }
+  }
+  g.count = 0;
+  g.size = MATCHES_START;
+  g.offsets = arena_alloc(sizeof(size_t) * g.size);
+  if (g.ncomps == 0 || g.offsets == NULL ||
+      !buffer_init(&g.names, PATH_MAX)) {
+    return g.ncomps == 0 ? 0 : -1;
+  }
+  g.reported = 0;
+  if (!walk(&g, pathlen, 0)) {
+    return g.reported ? -2 : -1;
+  }
+  if (g.count == 0) {
+    return 0;
+  }
+  // The names may have moved while growing, point at them only now
+  char **sorted = arena_alloc(sizeof(char *) * g.count);
+  if (sorted == NULL) {
+    return -1;
+  }
+  for (int k = 0; k < g.count; k++) {
+    sorted[k] = &g.names.data[g.offsets[k]];
+  }
+  qsort(sorted, g.count, sizeof(char *), compare_names);
+  for (int k = 0; k < g.count; k++) {
+    if ((k > 0 && !buffer_append(out, " ", 1)) ||
+        !buffer_append(out, sorted[k], strlen(sorted[k]))) {
+      return -1;
+    }
+  }
+  return g.count;
+}
+
+static int compile(struct component *comp, char *text) {
+  int len = strlen(text);
+  comp->text = text;
+  comp->literal = !glob_pattern(text);
+  comp->recursive = !strcmp(text, "**");
+  comp->toks = arena_alloc(sizeof(struct globtok) * (len + 1));
+  if (comp->toks == NULL) {
+    return 0;
+  }
+  int n = 0;
+  int w = 0; // Write position for the unescaped text
+  for (int i = 0; i < len; i++) {
+    struct globtok *tok = &comp->toks[n];
+    int used;
+    if (text[i] == '\\' && i + 1 < len) {
+      tok->type = GLOB_LITERAL;
+      tok->c = text[++i];
+    } else if (text[i] == '?') {
+      tok->type = GLOB_ANY;
+    } else if (text[i] == '*') {
+      // Runs of stars are the same as one
+      if (n > 0 && comp->toks[n - 1].type == GLOB_STAR) {
+        continue;
+      }
+      tok->type = GLOB_STAR;
+    } else if (text[i] == '[' && (used = parse_class(&text[i], tok)) > 0) {
+      i += used - 1;
+    } else {
+      tok->type = GLOB_LITERAL;
+      tok->c = text[i];
+    }
+    if (comp->literal) {
+      text[w++] = tok->c;
+    }
+    n++;
+  }
+  if (comp->literal) {
+    text[w] = 0;
+  }
+  comp->ntoks = n;
+  return 1;
+}
+
+/*
+ * Parse the [...] at p into tok. Returns how many characters it took, or 0
+ * if there is no closing ']' and the '[' is just a character.
+ */
+static int parse_class(const char *p, struct globtok *tok) {
+  int i = 1;
+  int negate = 0;
+  if (p[i] == '!' || p[i] == '^') {
+    negate = 1;
+    i++;
+  }
+  memset(tok->set, 0, sizeof(tok->set));
+  // A ']' right at the start is part of the set
+  int first = i;
+  while (p[i] != ']' || i == first) {
+    if (p[i] == 0 || p[i] == '/') {
+      return 0;
+    }
+    unsigned char lo = p[i];
+    unsigned char hi = lo;
+    if (p[i + 1] == '-' && p[i + 2] != ']' && p[i + 2] != 0) {
+      hi = p[i + 2];
+      i += 2;
+    }
+    for (int c = lo; c <= hi; c++) {
+      tok->set[c >> 3] |= 1 << (c & 7);
+    }
+    i++;
+  }
+  if (negate) {
+    for (int k = 0; k < 32; k++) {
+      tok->set[k] = ~tok->set[k];
+    }
+  }
+  tok->type = GLOB_CLASS;
+  return i + 1;
+}
+
+static int match(struct globtok *toks, int ntoks, const char *name) {
+  int t = 0;
+  int star = -1; // Token after the last '*' seen, -1 if there wasn't one
+  const char *resume = NULL; // Where that '*' would have to stop next time
+  while (*name != 0) {
+    unsigned char c = *name;
+    if (t < ntoks) {
+      struct globtok *tok = &toks[t];
+      if (tok->type == GLOB_STAR) {
+        star = ++t;
+        resume = name;
+        continue;
+      }
+      if (tok->type == GLOB_ANY || (tok->type == GLOB_LITERAL && tok->c == c) ||
+          (tok->type == GLOB_CLASS && (tok->set[c >> 3] & (1 << (c & 7))))) {
+        t++;
+        name++;
+        continue;
+      }
+    }
+    // Let the last '*' swallow one more character and try again from there
+    if (star < 0) {
+      return 0;
+    }
+    t = star;
+    name = ++resume;
+  }
+  while (t < ntoks && toks[t].type == GLOB_STAR) {
+    t++;
+  }
+  return t == ntoks;
+}
+
+static int walk(struct globber *g, size_t pathlen, int comp) {
+  struct component *c = &g->comps[comp];
+  int last = comp == g->ncomps - 1;
+  if (c->recursive) {
+    return walk_tree(g, pathlen, comp);
+  }
+  if (c->literal) {
+    // Nothing to match, it's there or it isn't
+    if (last) {
+      struct stat buf;
+      g->path[pathlen] = 0;
+      if (pathlen + strlen(c->text) >= PATH_MAX) {
+        return 1;
+      }
+      strcpy(&g->path[pathlen], c->text);
+      if (!lstat(g->path, &buf) && (!g->dirs_only || S_ISDIR(buf.st_mode))) {
+        return add_match(g, pathlen, c->text, g->dirs_only);
+      }
+      return 1;
+    }
+    int len = snprintf(&g->path[pathlen], PATH_MAX - pathlen, "%s/", c->text);
+    if (len >= (int) (PATH_MAX - pathlen)) {
+      return 1;
+    }
+    return walk(g, pathlen + len, comp + 1);
+  }
+  g->path[pathlen] = 0;
+  struct dirlist *list = dircache_read(pathlen > 0 ? g->path : ".");
+  if (list == NULL) {
+    // Not there or not readable, either way nothing matches
+    return 1;
+  }
+  int ok = 1;
+  char *name = list->names;
+  for (int k = 0; ok && k < list->count; k++, name += strlen(name) + 1) {
+    if (name[0] == '.' && c->text[0] != '.') {
+      continue;
+    }
+    if (!match(c->toks, c->ntoks, name)) {
+      continue;
+    }
+    if (last && !g->dirs_only) {
+      ok = add_match(g, pathlen, name, 0);
+      continue;
+    }
+    // Only directories can have more components under them
+    if (!is_dir(g, pathlen, name, list->types[k])) {
+      continue;
+    }
+    if (last) {
+      ok = add_match(g, pathlen, name, 1);
+      continue;
+    }
+    int len = snprintf(&g->path[pathlen], PATH_MAX - pathlen, "%s/", name);
+    if (len < (int) (PATH_MAX - pathlen)) {
+      ok = walk(g, pathlen + len, comp + 1);
+    }
+  }
+  dircache_release(list);
+  return ok;
+}
+
+static int walk_tree(struct globber *g, size_t pathlen, int comp) {
+  struct treewalk tw;
+  int last = comp == g->ncomps - 1;
+  struct component *next = last ? NULL : &g->comps[comp + 1];
+  g->path[pathlen] = 0;
+  tw.root = g->path;
+  tw.match = NULL;
+  tw.arg = NULL;
+  tw.hidden = 0;
+  tw.dirs_only = g->dirs_only;
+  tw.max_depth = g->max_depth;
+  tw.max_matches = g->max_matches - g->count;
+  if (next != NULL && comp + 1 == g->ncomps - 1 && !next->recursive) {
+    // **/NAME, the walker can match NAME itself at every level
+    tw.match = match_component;
+    tw.arg = next;
+    tw.hidden = next->text[0] == '.';
+  } else if (next != NULL) {
+    // Everything after it has to be tried below every directory
+    tw.dirs_only = 1;
+  }
+  if (!tree_walk(&tw)) {
+    g->reported = 1;
+    return 0;
+  }
+  int ok = 1;
+  if (next != NULL && tw.match == NULL) {
+    // ** matching no directories at all, then each one it found
+    ok = walk(g, pathlen, comp + 1);
+    for (char *name = tw.names; ok && name < tw.names + tw.len;
+         name += strlen(name) + 1) {
+      size_t len = strlen(name);
+      if (pathlen + len < PATH_MAX) {
+        memcpy(&g->path[pathlen], name, len + 1);
+        ok = walk(g, pathlen + len, comp + 1);
+      }
+    }
+  } else {
+    // The walker already added any trailing '/'
+    for (char *name = tw.names; ok && name < tw.names + tw.len;
+         name += strlen(name) + 1) {
+      ok = add_match(g, pathlen, name, 0);
+    }
+  }
+  free(tw.names);
+  return ok;
+}
+
+static int match_component(void *arg, const char *name) {
+  struct component *c = arg;
+  return match(c->toks, c->ntoks, name);
+}
+
+static long glob_limit(const char *name, long fallback) {
+  char *value = getenv(name);
+  char *end;
+  if (value == NULL) {
+    return fallback;
+  }
+  long limit = strtol(value, &end, 10);
+  return end == value || *end != 0 || limit < 0 ? fallback : limit;
+}
+
+static int is_dir(struct globber *g, size_t pathlen, const char *name,
+                  unsigned char type) {
+  struct stat buf;
+  if (type == DT_DIR) {
+    return 1;
+  }
+  if (type != DT_LNK && type != DT_UNKNOWN) {
+    return 0;
+  }
+  // Follow the link, or ask when the file system didn't say
+  if (pathlen + strlen(name) >= PATH_MAX) {
+    return 0;
+  }
+  strcpy(&g->path[pathlen], name);
+  return !stat(g->path, &buf) && S_ISDIR(buf.st_mode);
+}
+
+static int add_match(struct globber *g, size_t pathlen, const char *name,
+                     int slash) {
+  // The same cap the walker keeps to for **
+  if (g->count >= g->max_matches) {
+    fprintf(stderr, "glob: more than %ld matches, see USH_GLOB_MAX\n",
+            g->max_matches);
+    g->reported = 1;
+    return 0;
+  }
+  if (g->count == g->size) {
+    size_t *bigger = arena_grow(g->offsets, sizeof(size_t) * g->size,
+                                sizeof(size_t) * g->size * 2);
+    if (bigger == NULL) {
+      return 0;
+    }
+    g->offsets = bigger;
+    g->size *= 2;
+  }
+  g->offsets[g->count++] = g->names.len;
+  // The directories leading up to it, then the name itself
+  return buffer_append(&g->names, g->path, pathlen) &&
+         buffer_append(&g->names, name, strlen(name)) &&
+         (!slash || buffer_append(&g->names, "/", 1)) &&
+         buffer_append(&g->names, "", 1);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
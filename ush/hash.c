@@ -0,0 +1,191 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+// Constants
+#define HASH_BUCKETS 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+// Resolved command, path is NULL if the command was not found in PATH
+struct hashent {
+  char *name;
+  char *path;
+  int hits;
+  struct hashent *next;
+};
+
+// Prototypes
+static char *search_path(const char *name, int *cacheable);
+static struct hashent *hash_insert(const char *name, char *path);
+
+// Global Variables
+static struct hashent *hash_table[HASH_BUCKETS];
+static char *uncached_path; // Last result that could not be cached
+
+unsigned int hash_string(const char *str) {
+  // djb2
+  unsigned int hash = 5381;
+  while (*str) {
+    hash = hash * 33 + (unsigned char) *str++;
+  }
+  return hash;
+}
+
+char *hash_lookup(const char *name) {
+  struct hashent *entry = hash_table[hash_string(name) % HASH_BUCKETS];
+  // Use the cached result if there is one
+  for (; entry != NULL; entry = entry->next) {
+    if (!strcmp(entry->name, name)) {
+      entry->hits++;
+      return entry->path;
+    }
+  }
+  // Otherwise walk PATH and remember the result, even if nothing was found
+  int cacheable;
+  char *path = search_path(name, &cacheable);
+  if (!cacheable) {
+    // Keep it alive until the next lookup
+    free(uncached_path);
+    uncached_path = path;
+    return path;
+  }
+  entry = hash_insert(name, path);
+  if (entry == NULL) {
+    free(uncached_path);
+    uncached_path = path;
+    return path;
+  }
+  entry->hits++;
+  return entry->path;
+}
+
+int hash_add(const char *name) {
+  int cacheable;
+  char *path = search_path(name, &cacheable);
+  if (path == NULL) {
+    return 0;
+  }
+  hash_remove(name);
+  if (!cacheable || hash_insert(name, path) == NULL) {
+    free(path);
+  }
+  return 1;
+}
+
+void hash_remove(const char *name) {
+  struct hashent **link = &hash_table[hash_string(name) % HASH_BUCKETS];
+  while (*link != NULL) {
+    struct hashent *entry = *link;
+    if (!strcmp(entry->name, name)) {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+    link = &entry->next;
+  }
+}
+
+void hash_clear(void) {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    while (hash_table[i] != NULL) {
+      struct hashent *entry = hash_table[i];
+      hash_table[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
+
+void hash_print(int outfd) {
+  int printed = 0;
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    for (struct hashent *entry = hash_table[i]; entry; entry = entry->next) {
+      if (!printed) {
+        dprintf(outfd, "hits\tcommand\n");
+        printed = 1;
+      }
+      if (entry->path == NULL) {
+        dprintf(outfd, "%4d\t%s (not found)\n", entry->hits, entry->name);
+      } else {
+        dprintf(outfd, "%4d\t%s\n", entry->hits, entry->path);
+      }
+    }
+  }
+}
+
+static struct hashent *hash_insert(const char *name, char *path) {
+  struct hashent *entry = malloc(sizeof(struct hashent));
+  if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+    fprintf(stderr, "Malloc of command hash entry failed.\n");
+    free(entry);
+    return NULL;
+  }
+  entry->path = path;
+  entry->hits = 0;
+  // Add to the front of the bucket's chain
+  unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+  entry->next = hash_table[bucket];
+  hash_table[bucket] = entry;
+  return entry;
+}
+
+static char *search_path(const char *name, int *cacheable) {
+  const char *pathvar = getenv("PATH");
+  if (pathvar == NULL) {
+    pathvar = DEFAULT_PATH;
+  }
+  // Results found through relative directories change with the cwd
+  *cacheable = 1;
+  int namelen = strlen(name);
+  const char *dir = pathvar;
+  while (1) {
+    const char *end = strchr(dir, ':');
+    if (end == NULL) {
+      end = dir + strlen(dir);
+    }
+    int dirlen = end - dir;
+    if (dirlen == 0 || dir[0] != '/') {
+      *cacheable = 0;
+    }
+    // Build dir/name, an empty directory means the current one
+    char *candidate = malloc(dirlen + namelen + 3);
+    if (candidate == NULL) {
+      fprintf(stderr, "Malloc of command path failed.\n");
+      *cacheable = 0;
+      return NULL;
+    }
+    if (dirlen == 0) {
+      sprintf(candidate, "./%s", name);
+    } else {
+      sprintf(candidate, "%.*s/%s", dirlen, dir, name);
+    }
+    // Only regular, executable files count
+    struct stat buf;
+    if (!stat(candidate, &buf) && S_ISREG(buf.st_mode) &&
+        !access(candidate, X_OK)) {
+      if (candidate[0] != '/') {
+        *cacheable = 0;
+      }
+      return candidate;
+    }
+    free(candidate);
+    if (*end == 0) {
+      return NULL;
+    }
+    dir = end + 1;
+  }
+}
@@ -0,0 +1,477 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "defn.h"
+
+/*
+ * Job table and child supervisor. Every pipeline the shell launches is a job,
+ * and every child in it gets a pidfd registered with one epoll instance.
+ * Waiting is a blocking epoll_wait, and a readable pidfd names exactly which
+ * child to reap with waitpid, so no other job's status is ever lost. Kernels
+ * without pidfd_open fall back to waitpid on each specific pid. Children are
+ * reaped with wait4, so what each one cost is kept for the time keyword.
+ *
+ * Job ids shown to the user are table index + 1.
+ */
+
+// Constants
+#define JOBS_START 8
+#define MAX_EVENTS 16
+#define NO_EPOLL -2 // epfd value once pidfds turn out to be unsupported
+
+struct job {
+  int used;
+  int background;
+  char *cmd; // Command text for jobs and notifications
+  int nstages;
+  int nchildren;
+  int nlive;
+  struct child *children;
+  pid_t pgid;
+  pid_t last; // Pid of the final stage, 0 if that stage didn't fork
+  int status; // Wait status of the final stage
+};
+
+// Prototypes
+static int open_pidfd(pid_t pid);
+static void close_pidfd(struct job *j, int k);
+static int dispatch(int timeout);
+static void reap(int job, int k, int status, struct rusage *usage);
+static void reap_pid(pid_t pid, int status, struct rusage *usage);
+static void describe(struct job *j, char *buf, size_t size);
+
+// Global Variables
+static struct job *table;
+static int table_size;
+static int epfd = -1;
+static int nbackground; // Background jobs with children still running
+
+int job_start(struct pipeline *pl) {
+  int job;
+  // Reuse a free slot, or double the table
+  for (job = 0; job < table_size && table[job].used; job++);
+  if (job == table_size) {
+    int size = table_size ? table_size * 2 : JOBS_START;
+    struct job *bigger = realloc(table, sizeof(struct job) * size);
+    if (bigger == NULL) {
+      fprintf(stderr, "Realloc of job table failed.\n");
+      return -1;
+    }
+    memset(&bigger[table_size], 0, sizeof(struct job) * (size - table_size));
+    table = bigger;
+    table_size = size;
+  }
+  struct job *j = &table[job];
+  // Rebuild the command text, the line itself is gone after this line
+  size_t len = 3;
+  for (int i = 0; i < pl->nstages; i++) {
+    for (int k = 0; k < pl->stages[i].argc; k++) {
+      len += strlen(pl->stages[i].argv[k]) + 3;
+    }
+  }
+  j->cmd = malloc(len);
+  // Room for a stage each, and a fan-out pump for each run of |+
+  int nchildren = pl->nstages;
+  for (int i = 0; i < pl->nstages; i++) {
+    nchildren += pl->stages[i].fanout;
+  }
+  j->children = malloc(sizeof(struct child) * nchildren);
+  if (j->cmd == NULL || j->children == NULL) {
+    fprintf(stderr, "Malloc of job failed.\n");
+    free(j->cmd);
+    free(j->children);
+    return -1;
+  }
+  char *p = j->cmd;
+  for (int i = 0; i < pl->nstages; i++) {
+    if (i > 0) {
+      p += sprintf(p, pl->stages[i].fanout ? " |+" : " |");
+    }
+    for (int k = 0; k < pl->stages[i].argc; k++) {
+      p += sprintf(p, p == j->cmd ? "%s" : " %s", pl->stages[i].argv[k]);
+    }
+  }
+  j->used = 1;
+  j->background = pl->background;
+  j->nstages = pl->nstages;
+  j->nchildren = 0;
+  j->nlive = 0;
+  j->last = 0;
+  j->status = 0;
+  j->pgid = 0;
+  return job;
+}
+
+pid_t job_pgid(int job) {
+  struct job *j = &table[job];
+  // Background jobs get their own process group so ^C doesn't reach them
+  if (!j->background) {
+    return -1;
+  }
+  return j->pgid;
+}
+
+int job_add(int job, pid_t pid, int stage) {
+  struct job *j = &table[job];
+  int k = j->nchildren;
+  struct child *child = &j->children[k];
+  child->pid = pid;
+  child->stage = stage;
+  clock_gettime(CLOCK_MONOTONIC, &child->started);
+  memset(&child->usage, 0, sizeof(struct rusage));
+  child->pidfd = open_pidfd(pid);
+  if (child->pidfd >= 0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t) job << 32 | k;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, child->pidfd, &ev)) {
+      perror("epoll_ctl");
+      close(child->pidfd);
+      child->pidfd = -1;
+    }
+  }
+  if (stage == j->nstages - 1) {
+    j->last = pid;
+  }
+  if (j->background && k == 0) {
+    j->pgid = pid;
+  }
+  if (j->background && j->nlive == 0) {
+    nbackground++;
+  }
+  j->nchildren++;
+  j->nlive++;
+  return job;
+}
+
+int job_wait(int job, int *statusptr) {
+  struct job *j = &table[job];
+  if (!j->background) {
+    waiting_on = j->last;
+  }
+  // Children without a pidfd can only be waited on by pid
+  for (int i = 0; i < j->nchildren; i++) {
+    int status;
+    struct rusage usage;
+    if (j->children[i].pid > 0 && j->children[i].pidfd < 0 &&
+        wait4(j->children[i].pid, &status, 0, &usage) == j->children[i].pid) {
+      reap(job, i, status, &usage);
+    }
+  }
+  while (j->nlive > 0) {
+    if (j->background && sigint_caught) {
+      // Only wait itself was interrupted, the job keeps running
+      return -1;
+    }
+    // Sleep until some child exits, possibly one from another job
+    dispatch(-1);
+  }
+  if (!j->background) {
+    waiting_on = 0;
+  }
+  *statusptr = j->status;
+  return j->last > 0;
+}
+
+int job_wait_any(int *jobs, int n) {
+  while (1) {
+    int pidfds = 1; // "Boolean" representing if every live child has a pidfd
+    for (int i = 0; i < n; i++) {
+      struct job *j = &table[jobs[i]];
+      if (j->nlive == 0) {
+        return i;
+      }
+      for (int k = 0; k < j->nchildren; k++) {
+        if (j->children[k].pid > 0 && j->children[k].pidfd < 0) {
+          pidfds = 0;
+        }
+      }
+    }
+    if (sigint_caught) {
+      return -1;
+    }
+    if (epfd >= 0 && pidfds) {
+      dispatch(-1);
+    } else {
+      // Some child can only be waited on by pid, take whichever exits first
+      int status;
+      struct rusage usage;
+      pid_t pid = wait4(-1, &status, 0, &usage);
+      if (pid > 0) {
+        reap_pid(pid, status, &usage);
+      }
+    }
+  }
+}
+
+int job_wait_all(void) {
+  for (int job = 0; job < table_size; job++) {
+    int status;
+    if (table[job].used && table[job].background) {
+      if (job_wait(job, &status) < 0) {
+        return 0;
+      }
+      job_free(job);
+    }
+  }
+  return 1;
+}
+
+int job_find(const char *spec) {
+  if (spec[0] == '%') {
+    int job = atoi(&spec[1]) - 1;
+    if (job >= 0 && job < table_size && table[job].used &&
+        table[job].background) {
+      return job;
+    }
+    return -1;
+  }
+  // Otherwise it's the pid of any stage
+  pid_t pid = atoi(spec);
+  for (int job = 0; job < table_size; job++) {
+    if (table[job].used && table[job].background) {
+      for (int i = 0; i < table[job].nchildren; i++) {
+        if (pid > 0 && abs(table[job].children[i].pid) == pid) {
+          return job;
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+void job_free(int job) {
+  struct job *j = &table[job];
+  for (int i = 0; i < j->nchildren; i++) {
+    close_pidfd(j, i);
+  }
+  if (j->background && j->nlive > 0) {
+    nbackground--;
+  }
+  free(j->cmd);
+  free(j->children);
+  memset(j, 0, sizeof(struct job));
+}
+
+/*
+ * In a forked child of the shell, which can't wait on the shell's children
+ * and mustn't touch its epoll set: drop every job and start over. The
+ * caller closes the descriptors.
+ */
+void job_forget(void) {
+  for (int job = 0; job < table_size; job++) {
+    free(table[job].cmd);
+    free(table[job].children);
+    memset(&table[job], 0, sizeof(struct job));
+  }
+  if (epfd >= 0) {
+    epfd = -1;
+  }
+  nbackground = 0;
+}
+
+int job_id(int job) {
+  return job + 1;
+}
+
+pid_t job_last_pid(int job) {
+  struct job *j = &table[job];
+  return j->nchildren > 0 ? abs(j->children[j->nchildren - 1].pid) : 0;
+}
+
+int job_count(int job) {
+  return table[job].nchildren;
+}
+
+struct child *job_child(int job, int k) {
+  return &table[job].children[k];
+}
+
+void job_reap(void) {
+  // Foreground jobs are always waited on, so only background ones can finish
+  if (nbackground == 0) {
+    return;
+  }
+  if (epfd >= 0) {
+    while (dispatch(0) > 0);
+  }
+  // Children without a pidfd are polled by pid
+  for (int job = 0; job < table_size; job++) {
+    struct job *j = &table[job];
+    for (int i = 0; j->used && j->background && i < j->nchildren; i++) {
+      int status;
+      struct rusage usage;
+      if (j->children[i].pid > 0 && j->children[i].pidfd < 0 &&
+          wait4(j->children[i].pid, &status, WNOHANG, &usage) ==
+          j->children[i].pid) {
+        reap(job, i, status, &usage);
+      }
+    }
+  }
+}
+
+void job_print(int outfd, int done_only) {
+  char state[64];
+  job_reap();
+  for (int job = 0; job < table_size; job++) {
+    struct job *j = &table[job];
+    if (!j->used || !j->background || (done_only && j->nlive > 0)) {
+      continue;
+    }
+    describe(j, state, sizeof(state));
+    dprintf(outfd, "[%d]  %-12s %s\n", job_id(job), state, j->cmd);
+    // Finished jobs are forgotten once they have been reported
+    if (j->nlive == 0) {
+      job_free(job);
+    }
+  }
+}
+
+int report_status(int status, int outfd) {
+  if (WIFSIGNALED(status)) {
+    // Print signal description
+    if (outfd >= 0 && WTERMSIG(status) != SIGINT) {
+      dprintf(outfd, "%s", strsignal(WTERMSIG(status)));
+      #ifdef WCOREDUMP
+      if (WCOREDUMP(status)) {
+        dprintf(outfd, " (core dumped)");
+      }
+      #endif
+      dprintf(outfd, "\n");
+    }
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+static int open_pidfd(pid_t pid) {
+  if (epfd == NO_EPOLL) {
+    return -1;
+  }
+  if (epfd < 0) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      perror("epoll_create1");
+      epfd = NO_EPOLL;
+      return -1;
+    }
+  }
+#ifdef SYS_pidfd_open
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+#else
+  int fd = -1;
+  errno = ENOSYS;
+#endif
+  if (fd < 0) {
+    if (errno == ENOSYS) {
+      // Old kernel, every wait from now on goes by pid
+      close(epfd);
+      epfd = NO_EPOLL;
+    } else {
+      perror("pidfd_open");
+    }
+    return -1;
+  }
+  // pidfds are always close-on-exec, spawned commands never see them
+  return fd;
+}
+
+static void close_pidfd(struct job *j, int k) {
+  if (j->children[k].pidfd < 0) {
+    return;
+  }
+  // A child still on its way through exec may share the pidfd for a moment,
+  // so take it out of the epoll set by hand rather than relying on close()
+  epoll_ctl(epfd, EPOLL_CTL_DEL, j->children[k].pidfd, NULL);
+  close(j->children[k].pidfd);
+  j->children[k].pidfd = -1;
+}
+
+static int dispatch(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+  if (n < 0) {
+    if (errno != EINTR) {
+      perror("epoll_wait");
+    }
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    int job = events[i].data.u64 >> 32;
+    int k = events[i].data.u64 & 0xffffffff;
+    if (job >= table_size || !table[job].used || k >= table[job].nchildren ||
+        table[job].children[k].pid <= 0) {
+      // Already reaped, the event was queued before its pidfd went away
+      continue;
+    }
+    pid_t pid = table[job].children[k].pid;
+    int status;
+    struct rusage usage;
+    // A readable pidfd means this child, and only this child, has exited
+    if (wait4(pid, &status, WNOHANG, &usage) == pid) {
+      reap(job, k, status, &usage);
+    }
+  }
+  return n;
+}
+
+static void reap(int job, int k, int status, struct rusage *usage) {
+  struct job *j = &table[job];
+  close_pidfd(j, k);
+  clock_gettime(CLOCK_MONOTONIC, &j->children[k].ended);
+  j->children[k].usage = *usage;
+  if (j->children[k].pid == j->last) {
+    j->status = status;
+  }
+  if (trace_enabled) {
+    trace_child(j->cmd, &j->children[k].started, &j->children[k].ended,
+                j->children[k].pid);
+  }
+  // Mark it reaped so it is never waited on twice
+  j->children[k].pid = -j->children[k].pid;
+  j->nlive--;
+  if (j->background && j->nlive == 0) {
+    nbackground--;
+  }
+}
+
+static void reap_pid(pid_t pid, int status, struct rusage *usage) {
+  for (int job = 0; job < table_size; job++) {
+    for (int i = 0; table[job].used && i < table[job].nchildren; i++) {
+      if (table[job].children[i].pid == pid) {
+        reap(job, i, status, usage);
+        return;
+      }
+    }
+  }
+}
+
+static void describe(struct job *j, char *buf, size_t size) {
+  if (j->nlive > 0) {
+    snprintf(buf, size, "Running");
+  } else if (j->last == 0 || (WIFEXITED(j->status) &&
+             WEXITSTATUS(j->status) == 0)) {
+    snprintf(buf, size, "Done");
+  } else if (WIFEXITED(j->status)) {
+    snprintf(buf, size, "Exit %d", WEXITSTATUS(j->status));
+  } else {
+    snprintf(buf, size, "%s", strsignal(WTERMSIG(j->status)));
+  }
+}
@@ -0,0 +1,440 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "defn.h"
+
+// Constants
+#define MAX_SET 7
+#define TOKENS_START 16
+#define STAGES_START 4
+#define SITES_START 8
+
+// AddressSanitizer can't know the over-read in lex_scan() stays in the page,
+// so sanitized builds take the scalar loop instead
+#if defined(__SANITIZE_ADDRESS__)
+#define LEX_SCALAR
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LEX_SCALAR
+#endif
+#endif
+
+// Prototypes
+static int push_token(char ***tokens, int *count, int *size, char *token);
+static int only_spaces(const char *s);
+static int closed_class(const char *s);
+static int lex_redirect(const char *line, size_t *r, struct redirect *redir);
+
+/*
+ * Find the first byte at or after s[i] that is either 0 or one of the (at
+ * most seven) characters in set. Loads are aligned to the vector width, so
+ * the bytes they read before s[i] and past the terminating 0 always share a
+ * page with it and can't fault. They are masked off or come after the 0, so
+ * they never change the result.
+ */
+size_t lex_scan(const char *s, size_t i, const char *set) {
+  int nset = strlen(set);
+#if defined(__AVX2__) && !defined(LEX_SCALAR)
+  __m256i want[MAX_SET];
+  for (int j = 0; j < nset; j++) {
+    want[j] = _mm256_set1_epi8(set[j]);
+  }
+  const __m256i zero = _mm256_setzero_si256();
+  size_t misalign = (uintptr_t) &s[i] & 31;
+  const __m256i *vec = (const __m256i *) &s[i - misalign];
+  for (int first = 1;; first = 0, vec++) {
+    __m256i bytes = _mm256_load_si256(vec);
+    __m256i hits = _mm256_cmpeq_epi8(bytes, zero);
+    for (int j = 0; j < nset; j++) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, want[j]));
+    }
+    uint32_t mask = _mm256_movemask_epi8(hits);
+    if (first) {
+      // Ignore bytes before s[i]
+      mask >>= misalign;
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+      i += 32 - misalign;
+    } else {
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+      i += 32;
+    }
+  }
+#elif defined(__SSE2__) && !defined(LEX_SCALAR)
+  __m128i want[MAX_SET];
+  for (int j = 0; j < nset; j++) {
+    want[j] = _mm_set1_epi8(set[j]);
+  }
+  const __m128i zero = _mm_setzero_si128();
+  size_t misalign = (uintptr_t) &s[i] & 15;
+  const __m128i *vec = (const __m128i *) &s[i - misalign];
+  for (int first = 1;; first = 0, vec++) {
+    __m128i bytes = _mm_load_si128(vec);
+    __m128i hits = _mm_cmpeq_epi8(bytes, zero);
+    for (int j = 0; j < nset; j++) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, want[j]));
+    }
+    uint32_t mask = _mm_movemask_epi8(hits);
+    if (first) {
+      // Ignore bytes before s[i]
+      mask >>= misalign;
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+      i += 16 - misalign;
+    } else {
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+      i += 16;
+    }
+  }
+#else
+  // Scalar fallback, one table lookup per byte
+  unsigned char class[256] = {0};
+  class[0] = 1;
+  for (int j = 0; j < nset; j++) {
+    class[(unsigned char) set[j]] = 1;
+  }
+  while (!class[(unsigned char) s[i]]) {
+    i++;
+  }
+  return i;
+#endif
+}
+
+/*
+ * Turn every '\n' in the len bytes at s into a space, a vector at a time.
+ * $(...) output goes through here as it is read in, so the rewrite happens
+ * while the bytes are still in cache.
+ */
+void lex_unline(char *s, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i space = _mm256_set1_epi8(' ');
+  for (; i + 32 <= len; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *) &s[i]);
+    __m256i hits = _mm256_cmpeq_epi8(bytes, newline);
+    if (!_mm256_testz_si256(hits, hits)) {
+      bytes = _mm256_blendv_epi8(bytes, space, hits);
+      _mm256_storeu_si256((__m256i *) &s[i], bytes);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) &s[i]);
+    __m128i hits = _mm_cmpeq_epi8(bytes, newline);
+    if (_mm_movemask_epi8(hits)) {
+      // Spaces where there were newlines, the original bytes elsewhere
+      bytes = _mm_or_si128(_mm_and_si128(hits, space),
+                           _mm_andnot_si128(hits, bytes));
+      _mm_storeu_si128((__m128i *) &s[i], bytes);
+    }
+  }
+#endif
+  // Whatever is left over, or everything without vectors
+  for (; i < len; i++) {
+    if (s[i] == '\n') {
+      s[i] = ' ';
+    }
+  }
+}
+
+int lex_compile(char *line, struct lineir *ir) {
+  int sites_size = 0;
+  ir->flags = 0;
+  ir->nsites = 0;
+  ir->sites = NULL;
+  ir->pl = NULL;
+  size_t i = 0;
+  // Stop at each character that matters before expansion
+  while (line[i = lex_scan(line, i, "#$*?[")] != 0) {
+    if (line[i] == '#' && (i == 0 || line[i - 1] != '$')) {
+      // Comment found, remove it
+      line[i] = 0;
+      break;
+    }
+    if (line[i] == '[' && (i == 0 || line[i - 1] != '\\') &&
+        !closed_class(&line[i])) {
+      // Just a '[', like the test command, but "\[" still loses its '\'
+      i++;
+      continue;
+    }
+    if (line[i] != '#') {
+      // Record where expand() has work to do
+      if (ir->nsites == sites_size) {
+        int size = sites_size ? sites_size * 2 : SITES_START;
+        ir->sites = arena_grow(ir->sites, sizeof(unsigned int) * sites_size,
+                               sizeof(unsigned int) * size);
+        if (ir->sites == NULL) {
+          return 0;
+        }
+        sites_size = size;
+      }
+      ir->sites[ir->nsites++] = i;
+      ir->flags |= LEX_EXPAND;
+    }
+    i++;
+  }
+  ir->len = i;
+  // Note lines that are blank once the comment is gone
+  for (i = 0; line[i] == ' '; i++);
+  if (line[i] == 0) {
+    ir->flags |= LEX_EMPTY;
+  }
+  return 1;
+}
+
+int lex_split(char *line, struct pipeline *pl) {
+  int ntokens = 0;
+  int tokens_size = TOKENS_START;
+  char **tokens = arena_alloc(sizeof(char *) * tokens_size);
+  int nstages = 0;
+  int stages_size = STAGES_START;
+  struct stage *stages = arena_alloc(sizeof(struct stage) * stages_size);
+  if (tokens == NULL || stages == NULL) {
+    return 0;
+  }
+  // Each stage's argv is pointed into tokens once it stops moving
+  stages[0].argc = 0;
+  stages[0].redirs = NULL;
+  stages[0].fanout = 0;
+  struct redirect **tail = &stages[0].redirs;
+  struct redirect *pending = NULL; // Waiting for its file name
+  pl->background = 0;
+  size_t r = 0; // Read position in line
+  size_t w = 0; // Write position, quotes are squeezed out as we go
+  while (1) {
+    // Skip leading/trailing spaces
+    while (line[r] == ' ') {
+      r++;
+    }
+    char c = line[r];
+    if (c == '&' && only_spaces(&line[r + 1])) {
+      // A trailing '&' runs the whole line in the background
+      pl->background = 1;
+      c = 0;
+    }
+    if (pending == NULL && (c == '<' || c == '>' ||
+        (c >= '0' && c <= '9' && (line[r + 1] == '<' || line[r + 1] == '>')))) {
+      // Redirection, added to the stage's list in the order written
+      struct redirect *redir = arena_alloc(sizeof(struct redirect));
+      if (redir == NULL || !lex_redirect(line, &r, redir)) {
+        return 0;
+      }
+      *tail = redir;
+      tail = &redir->next;
+      pending = redir->type != REDIR_DUP ? redir : NULL;
+      continue;
+    }
+    if ((c == 0 || c == '|') && pending != NULL) {
+      fprintf(stderr, "Missing file name after redirection.\n");
+      return 0;
+    }
+    if (c != 0 && c != '|') {
+      // Argument found, copy it down to w without its quotes
+      char *token = &line[w];
+      int quoted = 0;
+      while (1) {
+        size_t end = lex_scan(line, r, quoted ? "\"\001" : " \"|&<>\001");
+        if (w != r) {
+          memmove(&line[w], &line[r], end - r);
+        }
+        w += end - r;
+        r = end;
+        c = line[r];
+        if (c == '"') {
+          quoted = !quoted;
+          r++;
+        } else if (c == LEX_LITERAL) {
+          // Expanded text, whatever follows is just a character
+          if (line[r + 1] != 0) {
+            line[w++] = line[r + 1];
+            r++;
+          }
+          r++;
+        } else if (c == '&') {
+          if (only_spaces(&line[r + 1])) {
+            // Trailing '&' glued to the last argument
+            pl->background = 1;
+            c = 0;
+            break;
+          }
+          // Anywhere else it's just a character
+          line[w++] = c;
+          r++;
+        } else if (c == 0 && quoted) {
+          fprintf(stderr, "Odd number of quotes found in input.\n");
+          return 0;
+        } else {
+          break;
+        }
+      }
+      struct redirect *glued = NULL;
+      if (c == '<' || c == '>') {
+        // A redirection right after the word, read before the terminator
+        // below can land on it
+        glued = arena_alloc(sizeof(struct redirect));
+        if (glued == NULL || !lex_redirect(line, &r, glued)) {
+          return 0;
+        }
+        c = ' ';
+      } else if (c != 0) {
+        r++;
+      }
+      // Terminate it, this may overwrite c itself when nothing was squeezed
+      line[w++] = 0;
+      if (pending != NULL) {
+        pending->path = token;
+        pending = NULL;
+      } else if (!push_token(&tokens, &ntokens, &tokens_size, token)) {
+        return 0;
+      } else {
+        stages[nstages].argc++;
+      }
+      if (glued != NULL) {
+        *tail = glued;
+        tail = &glued->next;
+        pending = glued->type != REDIR_DUP ? glued : NULL;
+      }
+    } else if (c == '|') {
+      r++;
+    }
+    if (c == '|' || c == 0) {
+      // End of stage, NULL terminate its argv
+      if (!push_token(&tokens, &ntokens, &tokens_size, NULL)) {
+        return 0;
+      }
+      nstages++;
+      if (c == 0) {
+        break;
+      }
+      // |+ hands the stage before the run to every stage in it
+      int fanout = line[r] == '+';
+      if (fanout) {
+        r++;
+      }
+      if (nstages == stages_size) {
+        stages = arena_grow(stages, sizeof(struct stage) * stages_size,
+                            sizeof(struct stage) * stages_size * 2);
+        if (stages == NULL) {
+          return 0;
+        }
+        stages_size *= 2;
+      }
+      stages[nstages].argc = 0;
+      stages[nstages].redirs = NULL;
+      stages[nstages].fanout = fanout;
+      tail = &stages[nstages].redirs;
+    }
+  }
+  // Every stage's argv is followed by its NULL in tokens
+  int start = 0;
+  for (int i = 0; i < nstages; i++) {
+    stages[i].argv = &tokens[start];
+    start += stages[i].argc + 1;
+  }
+  pl->stages = stages;
+  pl->nstages = nstages;
+  return 1;
+}
+
+/*
+ * Parse the redirection operator at line[*r] into redir and move *r past
+ * it: an optional descriptor, then <, >, >> or >|, or <& or >& and the
+ * descriptor to copy. The file name, if it takes one, is the next word.
+ */
+static int lex_redirect(const char *line, size_t *r, struct redirect *redir) {
+  size_t i = *r;
+  int fd = -1;
+  if (line[i] >= '0' && line[i] <= '9') {
+    fd = line[i++] - '0';
+  }
+  char op = line[i++];
+  redir->fd = fd >= 0 ? fd : op == '<' ? 0 : 1;
+  redir->path = NULL;
+  redir->next = NULL;
+  redir->type = op == '<' ? REDIR_IN : REDIR_OUT;
+  if (op == '>' && line[i] == '>') {
+    redir->type = REDIR_APPEND;
+    i++;
+  } else if (op == '>' && line[i] == '|') {
+    redir->type = REDIR_CLOBBER;
+    i++;
+  } else if (line[i] == '&') {
+    // The byte after the digit is only there if the digit is
+    int digit = line[i + 1] >= '0' && line[i + 1] <= '9';
+    char next = digit ? line[i + 2] : 0;
+    if (!digit || (next != 0 && next != ' ' && next != '|' && next != '<' &&
+                   next != '>' && next != '&')) {
+      fprintf(stderr, "Expected a descriptor after %c&.\n", op);
+      return 0;
+    }
+    redir->type = REDIR_DUP;
+    redir->dupfd = line[i + 1] - '0';
+    i += 2;
+  }
+  // Only the standard three are passed on to commands
+  if (redir->fd > 2 || (redir->type == REDIR_DUP && redir->dupfd > 2)) {
+    fprintf(stderr, "Only descriptors 0, 1 and 2 can be redirected.\n");
+    return 0;
+  }
+  *r = i;
+  return 1;
+}
+
+static int push_token(char ***tokens, int *count, int *size, char *token) {
+  if (*count == *size) {
+    char **bigger = arena_grow(*tokens, sizeof(char *) * *size,
+                               sizeof(char *) * *size * 2);
+    if (bigger == NULL) {
+      return 0;
+    }
+    *tokens = bigger;
+    *size *= 2;
+  }
+  (*tokens)[(*count)++] = token;
+  return 1;
+}
+
+static int only_spaces(const char *s) {
+  while (*s == ' ') {
+    s++;
+  }
+  return *s == 0;
+}
+
+static int closed_class(const char *s) {
+  // Skip a negation and a ']' right at the start, which is part of the set
+  int i = 1;
+  if (s[i] == '!' || s[i] == '^') {
+    i++;
+  }
+  if (s[i] == ']') {
+    i++;
+  }
+  // Then look for the end within the same word
+  for (; s[i] != 0 && s[i] != ' ' && s[i] != '"' && s[i] != '/'; i++) {
+    if (s[i] == ']') {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defn.h"
+
+/*
+ * Memoized command substitution. $(@COMMAND) runs COMMAND the first time
+ * and hands back the same output afterwards, for as long as the expanded
+ * command, the working directory and PATH stay the same. Only output of
+ * commands that exited with 0 is kept.
+ *
+ * memo [-c] [-t SECONDS]
+ *
+ * Prints the cache with its hit and miss counts. -c empties it, -t makes
+ * entries expire SECONDS after they were stored (0, the default, keeps
+ * them until cleared).
+ */
+
+// Constants
+#define MEMO_BUCKETS 64
+
+// Output of one command, value has had its newlines turned into spaces
+struct memoent {
+  char *key;
+  char *value;
+  size_t len;
+  struct timespec stored;
+  int hits;
+  struct memoent *next;
+};
+
+// Prototypes
+static double age(struct memoent *entry, struct timespec *now);
+static void memo_free(struct memoent *entry);
+
+// Global Variables
+static struct memoent *memo_table[MEMO_BUCKETS];
+static long memo_hits;
+static long memo_misses;
+static double memo_ttl;
+
+char *memo_key(const char *cmd) {
+  char cwd[PATH_MAX];
+  struct buffer key;
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    cwd[0] = 0;
+  }
+  const char *pathvar = getenv("PATH");
+  // Lines can't hold a newline, so it can't make two keys collide
+  if (!buffer_init(&key, 256) ||
+      !buffer_printf(&key, "%s\n%s\n%s", cmd, cwd,
+                     pathvar != NULL ? pathvar : "")) {
+    return NULL;
+  }
+  return key.data;
+}
+
+int memo_get(const char *key, struct buffer *out) {
+  struct memoent **link = &memo_table[hash_string(key) % MEMO_BUCKETS];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (*link != NULL) {
+    struct memoent *entry = *link;
+    if (!strcmp(entry->key, key)) {
+      if (memo_ttl > 0 && age(entry, &now) >= memo_ttl) {
+        // Stale, drop it and run the command again
+        *link = entry->next;
+        memo_free(entry);
+        break;
+      }
+      if (!buffer_append(out, entry->value, entry->len)) {
+        return 0;
+      }
+      entry->hits++;
+      memo_hits++;
+      return 1;
+    }
+    link = &entry->next;
+  }
+  memo_misses++;
+  return 0;
+}
+
+void memo_put(const char *key, const char *value, size_t len) {
+  struct memoent **link = &memo_table[hash_string(key) % MEMO_BUCKETS];
+  // Replace what is there, the same command may run twice on one line
+  while (*link != NULL) {
+    struct memoent *entry = *link;
+    if (!strcmp(entry->key, key)) {
+      *link = entry->next;
+      memo_free(entry);
+      break;
+    }
+    link = &entry->next;
+  }
+  struct memoent *entry = malloc(sizeof(struct memoent));
+  if (entry == NULL || (entry->key = strdup(key)) == NULL) {
+    fprintf(stderr, "Malloc of memo entry failed.\n");
+    free(entry);
+    return;
+  }
+  if ((entry->value = malloc(len + 1)) == NULL) {
+    fprintf(stderr, "Malloc of memo entry failed.\n");
+    free(entry->key);
+    free(entry);
+    return;
+  }
+  memcpy(entry->value, value, len);
+  entry->value[len] = 0;
+  entry->len = len;
+  entry->hits = 0;
+  clock_gettime(CLOCK_MONOTONIC, &entry->stored);
+  // Add to the front of the bucket's chain
+  unsigned int bucket = hash_string(key) % MEMO_BUCKETS;
+  entry->next = memo_table[bucket];
+  memo_table[bucket] = entry;
+}
+
+void memo_clear(void) {
+  for (int i = 0; i < MEMO_BUCKETS; i++) {
+    while (memo_table[i] != NULL) {
+      struct memoent *entry = memo_table[i];
+      memo_table[i] = entry->next;
+      memo_free(entry);
+    }
+  }
+  memo_hits = 0;
+  memo_misses = 0;
+}
+
+void memo(char **argpointers, int argc) {
+  int clear = 0;
+  int i;
+  // Parse options
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argpointers[i], "-c")) {
+      clear = 1;
+    } else if (!strcmp(argpointers[i], "-t") && i + 1 < argc) {
+      char *end;
+      double ttl = strtod(argpointers[++i], &end);
+      if (end == argpointers[i] || *end != 0 || ttl < 0) {
+        fprintf(stderr, "memo: %s: invalid number of seconds\n",
+                argpointers[i]);
+        last_exit = 1;
+        return;
+      }
+      memo_ttl = ttl;
+    } else {
+      fprintf(stderr, "Usage: memo [-c] [-t SECONDS]\n");
+      last_exit = 1;
+      return;
+    }
+  }
+  last_exit = 0;
+  if (clear) {
+    memo_clear();
+  }
+  if (argc > 1) {
+    return;
+  }
+  // Nothing to change, show what is cached
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int entries = 0;
+  for (int k = 0; k < MEMO_BUCKETS; k++) {
+    for (struct memoent *entry = memo_table[k]; entry; entry = entry->next) {
+      if (!entries++) {
+        builtin_printf("hits\tage\tcommand\n");
+      }
+      // Only the command part of the key
+      int cmdlen = strchr(entry->key, '\n') - entry->key;
+      builtin_printf("%4d\t%.1fs\t%.*s\n", entry->hits, age(entry, &now),
+                     cmdlen, entry->key);
+    }
+  }
+  builtin_printf("%d entries, %ld hits, %ld misses", entries, memo_hits,
+                 memo_misses);
+  if (memo_ttl > 0) {
+    builtin_printf(", expire after %gs", memo_ttl);
+  }
+  builtin_printf("\n");
+}
+
+static double age(struct memoent *entry, struct timespec *now) {
+  return (now->tv_sec - entry->stored.tv_sec) +
+         (now->tv_nsec - entry->stored.tv_nsec) / 1e9;
+}
+
+static void memo_free(struct memoent *entry) {
+  free(entry->key);
+  free(entry->value);
+  free(entry);
+}
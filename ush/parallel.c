@@ -0,0 +1,348 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * parallel [-j N] [-k] CMD [ARG...] [::: INPUT...]
+ *
+ * Runs CMD once per input, with every {} in it replaced by the input (or the
+ * input appended when there is no {}), keeping up to N lines in flight
+ * through run_pipeline() and the job table. Inputs come after ::: or, without
+ * it, one per line from standard input. -k buffers each line's output in a
+ * memfd and prints it in input order. The exit value is the number of lines
+ * that failed, at most 101.
+ *
+ * A one word CMD is a whole command line and may contain pipes. Otherwise
+ * every word of CMD is quoted, so arguments with spaces stay whole. Inputs
+ * are always quoted, with any '"' in them marked as a plain character. Each
+ * line's memory goes back to the arena as soon as it has started.
+ */
+
+// Constants
+#define MAX_FAILURES 101
+#define COPY_SIZE 65536
+
+// Task states
+#define TASK_FREE 0
+#define TASK_RUNNING 1
+#define TASK_DONE 2
+
+struct task {
+  int state;
+  int job;
+  int outfd; // memfd holding the output with -k
+  int failed;
+};
+
+// Prototypes
+static char *build_line(char **cmd, int ncmd, const char *input);
+static int append_quoted(struct buffer *line, const char *str);
+static int start_task(struct task *task, char *line, int infd, int outfd,
+                      int keep);
+static void finish_task(struct task *task, int status, int waited);
+static void flush_task(struct task *task, int outfd);
+
+void parallel(char **argpointers, int argc) {
+  int outfd = builtin_outfd;
+  int infd = builtin_infd;
+  int njobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int keep = 0;
+  int i;
+  // Parse options
+  for (i = 1; i < argc && argpointers[i][0] == '-'; i++) {
+    if (!strcmp(argpointers[i], "-k")) {
+      keep = 1;
+    } else if (!strcmp(argpointers[i], "-j") && i + 1 < argc) {
+      njobs = atoi(argpointers[++i]);
+    } else if (!strncmp(argpointers[i], "-j", 2) && argpointers[i][2] != 0) {
+      njobs = atoi(&argpointers[i][2]);
+    } else {
+      break;
+    }
+  }
+  // The command runs up to :::, inputs follow it
+  char **cmd = &argpointers[i];
+  int ncmd = 0;
+  while (i < argc && strcmp(argpointers[i], ":::")) {
+    ncmd++;
+    i++;
+  }
+  if (ncmd == 0 || njobs < 1) {
+    fprintf(stderr, "Usage: parallel [-j N] [-k] CMD [ARG...] [::: INPUT...]\n");
+    last_exit = 1;
+    return;
+  }
+  char **inputs = i < argc ? &argpointers[i + 1] : NULL;
+  int ninputs = i < argc ? argc - i - 1 : 0;
+  struct reader rd;
+  int taskinfd = 0;
+  if (inputs == NULL) {
+    if (!reader_open(&rd, infd)) {
+      last_exit = 1;
+      return;
+    }
+    // Lines must not eat the inputs meant for other lines
+    if ((taskinfd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+      perror("open");
+      reader_close(&rd);
+      last_exit = 1;
+      return;
+    }
+  }
+  // With -k, finished lines wait in their slot until everything before them
+  // has been printed, so allow twice as many slots as lines in flight
+  int nslots = keep ? njobs * 2 : njobs;
+  struct task *tasks = calloc(nslots, sizeof(struct task));
+  int *running = malloc(sizeof(int) * njobs);
+  int *slots = malloc(sizeof(int) * njobs);
+  if (tasks == NULL || running == NULL || slots == NULL) {
+    fprintf(stderr, "Malloc of parallel tasks failed.\n");
+    free(tasks);
+    free(running);
+    free(slots);
+    if (inputs == NULL) {
+      reader_close(&rd);
+      close(taskinfd);
+    }
+    last_exit = 1;
+    return;
+  }
+  size_t next = 0; // Number of lines started
+  size_t head = 0; // With -k, the next line to print
+  int nrunning = 0;
+  int failures = 0;
+  int eof = 0;
+  while (1) {
+    // Keep njobs lines in flight
+    while (!eof && !sigint_caught && nrunning < njobs) {
+      int slot = -1;
+      if (keep) {
+        if (tasks[next % nslots].state == TASK_FREE) {
+          slot = next % nslots;
+        }
+      } else {
+        for (int k = 0; k < nslots && slot < 0; k++) {
+          if (tasks[k].state == TASK_FREE) {
+            slot = k;
+          }
+        }
+      }
+      if (slot < 0) {
+        break;
+      }
+      // Next input
+      char *input;
+      size_t len;
+      if (inputs != NULL) {
+        input = next < (size_t) ninputs ? inputs[next] : NULL;
+      } else {
+        input = reader_next(&rd, &len);
+      }
+      if (input == NULL) {
+        eof = 1;
+        break;
+      }
+      // The job keeps what it needs, the line itself is done with once the
+      // task has started
+      struct arena_mark mark;
+      arena_mark(&mark);
+      char *line = build_line(cmd, ncmd, input);
+      if (line == NULL ||
+          !start_task(&tasks[slot], line, taskinfd, outfd, keep)) {
+        tasks[slot].state = TASK_DONE;
+        tasks[slot].outfd = outfd;
+        tasks[slot].failed = 1;
+      }
+      arena_release(&mark);
+      if (tasks[slot].state == TASK_RUNNING) {
+        nrunning++;
+      }
+      next++;
+    }
+    // Print whatever is ready, in order with -k
+    for (int k = 0; k < nslots; k++) {
+      struct task *task = &tasks[keep ? head % nslots : k];
+      if (task->state != TASK_DONE) {
+        if (keep) {
+          break;
+        }
+        continue;
+      }
+      failures += task->failed;
+      flush_task(task, outfd);
+      head++;
+    }
+    if (nrunning == 0 && (eof || sigint_caught)) {
+      break;
+    }
+    if (nrunning == 0) {
+      continue;
+    }
+    // Sleep until any line finishes
+    int n = 0;
+    for (int k = 0; k < nslots; k++) {
+      if (tasks[k].state == TASK_RUNNING) {
+        running[n] = tasks[k].job;
+        slots[n++] = k;
+      }
+    }
+    int done = job_wait_any(running, n);
+    if (done < 0) {
+      // ^C, stop starting lines and let the running ones finish dying
+      for (int k = 0; k < n; k++) {
+        int status;
+        int waited = job_wait(running[k], &status);
+        finish_task(&tasks[slots[k]], status, waited);
+      }
+      nrunning = 0;
+      continue;
+    }
+    int status;
+    int waited = job_wait(running[done], &status);
+    finish_task(&tasks[slots[done]], status, waited);
+    nrunning--;
+  }
+  // Anything still buffered was cut off by ^C, drop it
+  for (int k = 0; k < nslots; k++) {
+    if (tasks[k].state != TASK_FREE && keep) {
+      close(tasks[k].outfd);
+    }
+  }
+  if (inputs == NULL) {
+    reader_close(&rd);
+    close(taskinfd);
+  }
+  free(tasks);
+  free(running);
+  free(slots);
+  last_exit = sigint_caught ? 130 :
+              failures > MAX_FAILURES ? MAX_FAILURES : failures;
+}
+
+static char *build_line(char **cmd, int ncmd, const char *input) {
+  struct buffer line;
+  int replaced = 0;
+  if (!buffer_init(&line, 64)) {
+    return NULL;
+  }
+  for (int i = 0; i < ncmd; i++) {
+    // Quote each word unless the command is a single line of its own
+    const char *quote = ncmd > 1 ? "\"" : "";
+    const char *word = cmd[i];
+    const char *brace;
+    if (!buffer_printf(&line, "%s%s", i > 0 ? " " : "", quote)) {
+      return NULL;
+    }
+    while ((brace = strstr(word, "{}")) != NULL) {
+      // Inside the word's own quotes, or in quotes of its own
+      if (!buffer_append(&line, word, brace - word) ||
+          (ncmd == 1 && !buffer_append(&line, "\"", 1)) ||
+          !append_quoted(&line, input) ||
+          (ncmd == 1 && !buffer_append(&line, "\"", 1))) {
+        return NULL;
+      }
+      word = brace + 2;
+      replaced = 1;
+    }
+    if (!buffer_printf(&line, "%s%s", word, quote)) {
+      return NULL;
+    }
+  }
+  if (!replaced && (!buffer_append(&line, " \"", 2) ||
+                    !append_quoted(&line, input) ||
+                    !buffer_append(&line, "\"", 1))) {
+    return NULL;
+  }
+  return line.data;
+}
+
+// Append str for inside quotes, a '"' in it doesn't end them
+static int append_quoted(struct buffer *line, const char *str) {
+  while (1) {
+    size_t len = strcspn(str, "\"\001");
+    if (!buffer_append(line, str, len)) {
+      return 0;
+    }
+    if (str[len] == 0) {
+      return 1;
+    }
+    char marked[2] = {LEX_LITERAL, str[len]};
+    if (!buffer_append(line, marked, 2)) {
+      return 0;
+    }
+    str += len + 1;
+  }
+}
+
+static int start_task(struct task *task, char *line, int infd, int outfd,
+                      int keep) {
+  task->failed = 0;
+  task->outfd = outfd;
+  if (keep) {
+    // Output waits here until it is this line's turn
+    task->outfd = memfd_create("parallel", MFD_CLOEXEC);
+    if (task->outfd < 0) {
+      perror("memfd_create");
+      return 0;
+    }
+  }
+  // Already expanded once on the way into parallel, and a '#' from an input
+  // is no comment, so it is only split
+  struct pipeline pl;
+  int job = lex_split(line, &pl) ?
+            run_pipeline(&pl, infd, task->outfd, NOWAIT) : -1;
+  if (job < 0) {
+    if (keep) {
+      close(task->outfd);
+    }
+    return 0;
+  }
+  if (job == 0) {
+    // Only builtins ran, nothing to wait for
+    task->state = TASK_DONE;
+    task->failed = last_exit != 0;
+    return 1;
+  }
+  task->job = job - 1;
+  task->state = TASK_RUNNING;
+  return 1;
+}
+
+static void finish_task(struct task *task, int status, int waited) {
+  if (waited > 0) {
+    task->failed = report_status(status, -1) != 0;
+  }
+  job_free(task->job);
+  task->state = TASK_DONE;
+}
+
+static void flush_task(struct task *task, int outfd) {
+  char buf[COPY_SIZE];
+  ssize_t chars;
+  if (task->outfd != outfd) {
+    // Copy the buffered output out and let the memfd go
+    lseek(task->outfd, 0, SEEK_SET);
+    while ((chars = read(task->outfd, buf, sizeof(buf))) > 0) {
+      if (write(outfd, buf, chars) != chars) {
+        perror("write");
+        break;
+      }
+    }
+    close(task->outfd);
+  }
+  task->state = TASK_FREE;
+}
@@ -0,0 +1,121 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+// Constants
+#define READ_CHUNK 65536
+
+int reader_open(struct reader *rd, int fd) {
+  memset(rd, 0, sizeof(struct reader));
+  rd->fd = fd;
+  // Regular files are mapped whole, everything else goes through read()
+  struct stat buf;
+  if (fstat(fd, &buf)) {
+    perror("fstat");
+    return 0;
+  }
+  if (S_ISREG(buf.st_mode) && buf.st_size > 0) {
+    rd->map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (rd->map != MAP_FAILED) {
+      rd->maplen = buf.st_size;
+      madvise(rd->map, rd->maplen, MADV_SEQUENTIAL);
+      return 1;
+    }
+    rd->map = NULL;
+  }
+  rd->bufsize = READ_CHUNK;
+  rd->buf = malloc(rd->bufsize);
+  if (rd->buf == NULL) {
+    fprintf(stderr, "Malloc of script read buffer failed.\n");
+    return 0;
+  }
+  return 1;
+}
+
+char *reader_next(struct reader *rd, size_t *lenptr) {
+  if (rd->map != NULL) {
+    if (rd->pos >= rd->maplen) {
+      return NULL;
+    }
+    // Find the end of the line, memchr scans a vector at a time
+    char *line = &rd->map[rd->pos];
+    size_t left = rd->maplen - rd->pos;
+    char *newline = memchr(line, '\n', left);
+    size_t len = newline == NULL ? left : (size_t) (newline - line);
+    rd->pos += len + 1;
+    // The mapping is shared with the page cache, terminate a copy in the arena
+    char *copy = arena_alloc(len + 1);
+    if (copy == NULL) {
+      return NULL;
+    }
+    memcpy(copy, line, len);
+    copy[len] = 0;
+    *lenptr = len;
+    return copy;
+  }
+  while (1) {
+    // Hand out the next complete line already in the buffer
+    char *line = &rd->buf[rd->start];
+    char *newline = memchr(line, '\n', rd->end - rd->start);
+    if (newline != NULL) {
+      *newline = 0;
+      rd->start += newline - line + 1;
+      *lenptr = newline - line;
+      return line;
+    }
+    if (rd->eof) {
+      if (rd->start == rd->end) {
+        return NULL;
+      }
+      // Last line without a newline, there is always room for the 0
+      rd->buf[rd->end] = 0;
+      *lenptr = rd->end - rd->start;
+      rd->start = rd->end;
+      return line;
+    }
+    // Move the partial line to the front and make room for more
+    memmove(rd->buf, line, rd->end - rd->start);
+    rd->end -= rd->start;
+    rd->start = 0;
+    if (rd->bufsize - rd->end < READ_CHUNK / 2) {
+      char *bigger = realloc(rd->buf, rd->bufsize * 2);
+      if (bigger == NULL) {
+        fprintf(stderr, "Realloc of script read buffer failed.\n");
+        return NULL;
+      }
+      rd->buf = bigger;
+      rd->bufsize *= 2;
+    }
+    // Leave one byte spare to terminate a final unterminated line
+    ssize_t chars = read(rd->fd, &rd->buf[rd->end],
+                         rd->bufsize - rd->end - 1);
+    if (chars < 0) {
+      perror("read");
+      return NULL;
+    }
+    if (chars == 0) {
+      rd->eof = 1;
+    }
+    rd->end += chars;
+  }
+}
+
+void reader_close(struct reader *rd) {
+  if (rd->map != NULL) {
+    munmap(rd->map, rd->maplen);
+  }
+  free(rd->buf);
+  memset(rd, 0, sizeof(struct reader));
+}
@@ -0,0 +1,210 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+extern char **environ;
+
+/*
+ * Launch argpointers as a child process with infd as its stdin, outfd as
+ * its stdout and errfd as its stderr. A pgid of 0 puts the child in a new
+ * process group of its own, a positive pgid joins that group, and -1 leaves
+ * it in the shell's. posix_spawn shares the parent's address space until the
+ * exec (clone with CLONE_VM | CLONE_VFORK in glibc), so no page tables are
+ * copied no matter how large the shell's stack is. Bare command names are
+ * resolved with the PATH cache in hash.c, so the child execs exactly once.
+ *
+ * Returns the child's pid, 0 if the command could not be executed (the error
+ * is reported and last_exit is set to 127), or -1 on an internal failure.
+ */
+int spawn_command(char **argpointers, int infd, int outfd, int errfd,
+                  pid_t pgid) {
+  posix_spawn_file_actions_t actions;
+  int fds[3] = {infd, outfd, errfd};
+  int copies[3] = {-1, -1, -1};
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  pid_t cpid;
+  int err;
+  // Its output has to come after what builtins have held back
+  builtin_flush();
+  if ((err = posix_spawnattr_init(&attr))) {
+    fprintf(stderr, "posix_spawnattr_init: %s\n", strerror(err));
+    return -1;
+  }
+  // The caller may hold SIGINT blocked, the child must not inherit that
+  sigprocmask(SIG_BLOCK, NULL, &mask);
+  sigdelset(&mask, SIGINT);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  if (pgid >= 0) {
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                             POSIX_SPAWN_SETPGROUP);
+  } else {
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  }
+  if ((err = posix_spawn_file_actions_init(&actions))) {
+    fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(err));
+    posix_spawnattr_destroy(&attr);
+    return -1;
+  }
+  // One of 0, 1 and 2 moving to another of them (2>&1) is copied out of the
+  // way first, the dup2() onto it could otherwise come before its own
+  for (int k = 0; k < 3; k++) {
+    if (fds[k] >= 0 && fds[k] <= 2 && fds[k] != k) {
+      if ((copies[k] = fcntl(fds[k], F_DUPFD_CLOEXEC, 3)) < 0) {
+        perror("fcntl");
+        err = -1;
+        break;
+      }
+      fds[k] = copies[k];
+    }
+  }
+  // Replace stdin, stdout and stderr, then close the originals once each
+  for (int k = 0; k < 3 && !err; k++) {
+    if (fds[k] != k) {
+      err = posix_spawn_file_actions_adddup2(&actions, fds[k], k);
+    }
+  }
+  for (int k = 0; k < 3 && !err; k++) {
+    if (fds[k] > 2 && (k == 0 || fds[k] != fds[0]) &&
+        (k < 2 || fds[k] != fds[1])) {
+      err = posix_spawn_file_actions_addclose(&actions, fds[k]);
+    }
+  }
+  if (err) {
+    if (err > 0) {
+      fprintf(stderr, "posix_spawn_file_actions: %s\n", strerror(err));
+    }
+    for (int k = 0; k < 3; k++) {
+      if (copies[k] >= 0) {
+        close(copies[k]);
+      }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return -1;
+  }
+  // Resolve the command through the PATH cache unless a path was given
+  char *path = argpointers[0];
+  if (strchr(path, '/') == NULL) {
+    path = hash_lookup(argpointers[0]);
+  }
+  // Attempt to execute the command
+  if (path == NULL) {
+    err = ENOENT;
+  } else {
+    err = posix_spawn(&cpid, path, &actions, &attr, argpointers, environ);
+    if (err == ENOENT && path != argpointers[0]) {
+      // The cached binary went away, search PATH again
+      hash_remove(argpointers[0]);
+      path = hash_lookup(argpointers[0]);
+      if (path != NULL) {
+        err = posix_spawn(&cpid, path, &actions, &attr, argpointers, environ);
+      }
+    }
+    if (err == ENOEXEC) {
+      // No #! line, execvp() would have handed it to the shell
+      int argc = 0;
+      while (argpointers[argc] != NULL) {
+        argc++;
+      }
+      char **shargv = arena_alloc(sizeof(char *) * (argc + 2));
+      if (shargv != NULL) {
+        shargv[0] = "/bin/sh";
+        shargv[1] = path;
+        memcpy(&shargv[2], &argpointers[1], sizeof(char *) * argc);
+        err = posix_spawn(&cpid, shargv[0], &actions, &attr, shargv,
+                          environ);
+      }
+    }
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  for (int k = 0; k < 3; k++) {
+    if (copies[k] >= 0) {
+      close(copies[k]);
+    }
+  }
+  if (err) {
+    // Report the failure the same way the forked child used to
+    errno = err;
+    perror("exec");
+    if (err == E2BIG) {
+      fprintf(stderr, "Too many arguments for one command, "
+              "run it as: batch %s ...\n", argpointers[0]);
+    }
+    last_exit = 127;
+    return 0;
+  }
+  return cpid;
+}
+
+/*
+ * Run a builtin in a forked child of the shell, as a stage of its own that
+ * streams into the next one while the rest of the pipeline starts. The
+ * child gets fds as its stdin, stdout and stderr, and nothing else the
+ * shell has open, so a pipe it writes sees its reader leave. Nothing it
+ * does to the shell's state outlives it. Returns the child's pid, or -1.
+ */
+pid_t spawn_builtin(struct builtin *builtin, char **argpointers, int argc,
+                    int fds[3], pid_t pgid) {
+  // Whatever stdio or the builtins hold would otherwise be written twice
+  builtin_flush();
+  fflush(stdout);
+  fflush(stderr);
+  pid_t cpid = fork();
+  if (cpid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (cpid > 0) {
+    if (pgid >= 0) {
+      // Both sides set it, whichever runs first
+      setpgid(cpid, pgid > 0 ? pgid : cpid);
+    }
+    return cpid;
+  }
+  // Killed by ^C like any other stage
+  signal(SIGINT, SIG_DFL);
+  if (pgid >= 0) {
+    setpgid(0, pgid);
+  }
+  // Same moves as for a spawned command, then close everything else
+  int copies[3];
+  for (int k = 0; k < 3; k++) {
+    copies[k] = fds[k] >= 0 && fds[k] <= 2 && fds[k] != k ?
+                fcntl(fds[k], F_DUPFD_CLOEXEC, 3) : fds[k];
+  }
+  for (int k = 0; k < 3; k++) {
+    if (copies[k] != k && dup2(copies[k], k) < 0) {
+      perror("dup2");
+      _exit(1);
+    }
+  }
+  job_forget();
+  close_range(3, ~0U, 0);
+  builtin_hold_init();
+  waiting_on = 0;
+  capture = NULL;
+  builtin_capture = NULL;
+  trace_enabled = 0;
+  run_builtin(builtin, argpointers, argc, 0, 1);
+  builtin_flush();
+  fflush(NULL);
+  _exit(last_exit);
+}
@@ -0,0 +1,248 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * time [-j] COMMAND [| COMMAND...]
+ *
+ * Runs the pipeline as usual, then reports on stderr its wall clock time and
+ * what every stage cost according to wait4(): user and system CPU, max RSS,
+ * voluntary and involuntary context switches and major faults, followed by
+ * a total row for pipelines. -j prints one JSON object per run instead.
+ * A stage that ran inside the shell, as a builtin at the end of a pipeline
+ * does, costs no process of its own and is listed with dashes for numbers
+ * (in JSON, as "builtin":true).
+ */
+
+// Prototypes
+static double seconds(struct timespec *from, struct timespec *to);
+static double cpu(struct timeval *tv);
+static void add_usage(struct rusage *total, struct rusage *usage);
+static void add_timeval(struct timeval *total, struct timeval *tv);
+static int append_json_string(struct buffer *out, const char *str);
+static const char *child_name(struct pipeline *pl, struct child *child);
+static int text_row(struct buffer *out, const char *name,
+                    struct child *child);
+static int json_stage(struct buffer *out, int stage, const char *name,
+                      struct child *child);
+static struct child *stage_child(int job, int stage, int *from);
+
+int time_keyword(struct pipeline *pl) {
+  struct stage *stage = &pl->stages[0];
+  int format = TIME_TEXT;
+  int skip = 1;
+  if (stage->argc == 0 || strcmp(stage->argv[0], "time")) {
+    return 0;
+  }
+  if (stage->argc > 1 && !strcmp(stage->argv[1], "-j")) {
+    format = TIME_JSON;
+    skip++;
+  }
+  if (stage->argc == skip) {
+    fprintf(stderr, "Usage: time [-j] COMMAND\n");
+    last_exit = 1;
+    return -1;
+  }
+  // The rest of the stage is the command being timed
+  stage->argv += skip;
+  stage->argc -= skip;
+  return format;
+}
+
+void time_report(struct pipeline *pl, int job, struct timespec *started,
+                 int format, int outfd) {
+  struct timespec now;
+  struct rusage total;
+  struct buffer out;
+  int n = job_count(job);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  memset(&total, 0, sizeof(struct rusage));
+  for (int k = 0; k < n; k++) {
+    add_usage(&total, &job_child(job, k)->usage);
+  }
+  // Built up in the arena and written at once
+  if (!buffer_init(&out, 256)) {
+    return;
+  }
+  int ok = 1;
+  if (format == TIME_JSON) {
+    // Rebuild the command from the pipeline
+    ok = buffer_printf(&out, "{\"command\":\"");
+    for (int i = 0; i < pl->nstages && ok; i++) {
+      for (int j = 0; j < pl->stages[i].argc && ok; j++) {
+        if (i > 0 || j > 0) {
+          ok = buffer_printf(&out, j > 0 ? " " :
+                             pl->stages[i].fanout ? " |+ " : " | ");
+        }
+        ok = ok && append_json_string(&out, pl->stages[i].argv[j]);
+      }
+    }
+    ok = ok && buffer_printf(&out, "\",\"exit\":%d,\"real\":%.6f,"
+                             "\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                             "\"vcsw\":%ld,\"ivcsw\":%ld,\"majflt\":%ld,"
+                             "\"stages\":[", last_exit,
+                             seconds(started, &now), cpu(&total.ru_utime),
+                             cpu(&total.ru_stime), total.ru_maxrss,
+                             total.ru_nvcsw, total.ru_nivcsw, total.ru_majflt);
+    // Every stage in order, then the fan-out pumps
+    for (int i = -1; i < pl->nstages && ok; i++) {
+      int stage = i < pl->nstages - 1 ? i + 1 : -1;
+      int from = 0;
+      struct child *child = stage_child(job, stage, &from);
+      if (child == NULL && stage >= 0) {
+        ok = (i < 0 || buffer_append(&out, ",", 1)) &&
+             json_stage(&out, stage, pl->stages[stage].argv[0], NULL);
+      }
+      for (; child != NULL && ok; child = stage_child(job, stage, &from)) {
+        ok = (i < 0 || buffer_append(&out, ",", 1)) &&
+             json_stage(&out, stage, child_name(pl, child), child);
+      }
+    }
+    ok = ok && buffer_printf(&out, "]}\n");
+  } else {
+    ok = buffer_printf(&out, "%-12s %9s %9s %9s %10s %6s %6s %6s\n",
+                       "command", "real", "user", "sys", "maxrss", "vcsw",
+                       "ivcsw", "majflt");
+    // One row per stage, then the pumps, then the total if there was more
+    // than one process
+    for (int i = -1; i < pl->nstages && ok; i++) {
+      int stage = i < pl->nstages - 1 ? i + 1 : -1;
+      int from = 0;
+      struct child *child = stage_child(job, stage, &from);
+      if (child == NULL && stage >= 0) {
+        ok = text_row(&out, pl->stages[stage].argv[0], NULL);
+      }
+      for (; child != NULL && ok; child = stage_child(job, stage, &from)) {
+        ok = text_row(&out, child_name(pl, child), child);
+      }
+    }
+    if (n > 1 && ok) {
+      ok = buffer_printf(&out, "%-12s %8.3fs %8.3fs %8.3fs %8ldKB %6ld %6ld "
+                         "%6ld\n", "total", seconds(started, &now),
+                         cpu(&total.ru_utime), cpu(&total.ru_stime),
+                         total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw,
+                         total.ru_majflt);
+    }
+  }
+  if (ok && write(outfd, out.data, out.len) < 0) {
+    perror("write");
+  }
+}
+
+static double seconds(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double cpu(struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void add_usage(struct rusage *total, struct rusage *usage) {
+  add_timeval(&total->ru_utime, &usage->ru_utime);
+  add_timeval(&total->ru_stime, &usage->ru_stime);
+  // Stages run side by side, so the peak is the largest one, not the sum
+  if (usage->ru_maxrss > total->ru_maxrss) {
+    total->ru_maxrss = usage->ru_maxrss;
+  }
+  total->ru_nvcsw += usage->ru_nvcsw;
+  total->ru_nivcsw += usage->ru_nivcsw;
+  total->ru_majflt += usage->ru_majflt;
+}
+
+static void add_timeval(struct timeval *total, struct timeval *tv) {
+  total->tv_sec += tv->tv_sec;
+  total->tv_usec += tv->tv_usec;
+  if (total->tv_usec >= 1000000) {
+    total->tv_sec++;
+    total->tv_usec -= 1000000;
+  }
+}
+
+static int append_json_string(struct buffer *out, const char *str) {
+  while (*str != 0) {
+    // Copy everything that needs no escaping in one go
+    size_t run = 0;
+    while (str[run] != 0 && str[run] != '"' && str[run] != '\\' &&
+           (unsigned char) str[run] >= 0x20) {
+      run++;
+    }
+    if (!buffer_append(out, str, run)) {
+      return 0;
+    }
+    str += run;
+    if (*str == '"' || *str == '\\') {
+      if (!buffer_printf(out, "\\%c", *str)) {
+        return 0;
+      }
+      str++;
+    } else if (*str != 0) {
+      if (!buffer_printf(out, "\\u%04x", (unsigned char) *str)) {
+        return 0;
+      }
+      str++;
+    }
+  }
+  return 1;
+}
+
+static int text_row(struct buffer *out, const char *name,
+                    struct child *child) {
+  if (child == NULL) {
+    return buffer_printf(out, "%-12.12s %9s %9s %9s %10s %6s %6s %6s\n", name,
+                         "-", "-", "-", "-", "-", "-", "-");
+  }
+  struct rusage *usage = &child->usage;
+  return buffer_printf(out, "%-12.12s %8.3fs %8.3fs %8.3fs %8ldKB %6ld %6ld "
+                       "%6ld\n", name, seconds(&child->started, &child->ended),
+                       cpu(&usage->ru_utime), cpu(&usage->ru_stime),
+                       usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+                       usage->ru_majflt);
+}
+
+static int json_stage(struct buffer *out, int stage, const char *name,
+                      struct child *child) {
+  if (!buffer_printf(out, "{\"stage\":%d,\"command\":\"", stage) ||
+      !append_json_string(out, name)) {
+    return 0;
+  }
+  if (child == NULL) {
+    return buffer_printf(out, "\",\"builtin\":true}");
+  }
+  struct rusage *usage = &child->usage;
+  return buffer_printf(out, "\",\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                       "\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld,"
+                       "\"majflt\":%ld}",
+                       seconds(&child->started, &child->ended),
+                       cpu(&usage->ru_utime), cpu(&usage->ru_stime),
+                       usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+                       usage->ru_majflt);
+}
+
+// Next process of the job run for stage, from *from on, NULL once there are
+// no more
+static struct child *stage_child(int job, int stage, int *from) {
+  int n = job_count(job);
+  while (*from < n) {
+    struct child *child = job_child(job, (*from)++);
+    if (child->stage == stage) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+// Fan-out pumps belong to no stage
+static const char *child_name(struct pipeline *pl, struct child *child) {
+  return child->stage >= 0 ? pl->stages[child->stage].argv[0] : "|+";
+}
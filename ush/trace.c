@@ -0,0 +1,150 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Execution tracer. With USH_TRACE=FILE in the environment, the shell writes
+ * Chrome trace-event JSON to FILE (load it in chrome://tracing or Perfetto).
+ * The shell's own work is recorded as nested begin/end spans on one track,
+ * and every child process gets a complete event on a track of its own,
+ * running from its spawn to its reaping.
+ *
+ * Call sites go through the TRACE_BEGIN/TRACE_END macros in defn.h, which
+ * cost a single test of trace_enabled when tracing is off. Events are
+ * buffered and written out when the buffer fills and when the shell exits.
+ * USH_TRACE is removed from the environment once the file is open, so
+ * scripts started by a traced shell don't overwrite its trace.
+ */
+
+// Constants
+#define TRACE_BUFFER 65536
+#define TRACE_NAME 64
+#define TRACE_DETAIL 200
+#define TRACE_EVENT_MAX 2048 // Longest event, with every detail byte escaped
+
+// Prototypes
+static void trace_flush(void);
+static void trace_header(const char *name, char phase, struct timespec *when,
+                         int tid);
+static void trace_detail(const char *detail);
+static char *trace_string(char *p, const char *str, int max);
+
+// Global Variables
+static int tracefd = -1;
+static char tracebuf[TRACE_BUFFER];
+static size_t tracelen;
+static int nevents;
+static struct timespec epoch;
+static pid_t tracepid;
+
+void trace_open(void) {
+  char *path = getenv("USH_TRACE");
+  if (path == NULL || path[0] == 0) {
+    return;
+  }
+  tracefd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (tracefd < 0) {
+    perror("open");
+    return;
+  }
+  unsetenv("USH_TRACE");
+  clock_gettime(CLOCK_MONOTONIC, &epoch);
+  tracepid = getpid();
+  tracelen = sprintf(tracebuf, "[\n");
+  atexit(trace_close);
+  trace_enabled = 1;
+}
+
+void trace_close(void) {
+  if (!trace_enabled) {
+    return;
+  }
+  trace_enabled = 0;
+  tracelen += sprintf(&tracebuf[tracelen], "\n]\n");
+  trace_flush();
+  close(tracefd);
+  tracefd = -1;
+}
+
+void trace_event(char phase, const char *name, const char *detail) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  trace_header(name, phase, &now, tracepid);
+  trace_detail(detail);
+}
+
+void trace_child(const char *name, struct timespec *started,
+                 struct timespec *ended, pid_t pid) {
+  double dur = (ended->tv_sec - started->tv_sec) * 1e6 +
+               (ended->tv_nsec - started->tv_nsec) / 1e3;
+  trace_header(name, 'X', started, pid);
+  tracelen += sprintf(&tracebuf[tracelen], ",\"dur\":%.3f", dur);
+  trace_detail(NULL);
+}
+
+static void trace_flush(void) {
+  size_t written = 0;
+  while (written < tracelen) {
+    ssize_t chars = write(tracefd, &tracebuf[written], tracelen - written);
+    if (chars < 0) {
+      perror("write");
+      break;
+    }
+    written += chars;
+  }
+  tracelen = 0;
+}
+
+static void trace_header(const char *name, char phase, struct timespec *when,
+                         int tid) {
+  if (tracelen + TRACE_EVENT_MAX > TRACE_BUFFER) {
+    trace_flush();
+  }
+  double ts = (when->tv_sec - epoch.tv_sec) * 1e6 +
+              (when->tv_nsec - epoch.tv_nsec) / 1e3;
+  char *p = &tracebuf[tracelen];
+  p += sprintf(p, "%s{\"name\":\"", nevents++ ? ",\n" : "");
+  p = trace_string(p, name, TRACE_NAME);
+  p += sprintf(p, "\",\"cat\":\"ush\",\"ph\":\"%c\",\"ts\":%.3f,"
+               "\"pid\":%d,\"tid\":%d", phase, ts, tracepid, tid);
+  tracelen = p - tracebuf;
+}
+
+static void trace_detail(const char *detail) {
+  char *p = &tracebuf[tracelen];
+  if (detail != NULL) {
+    p += sprintf(p, ",\"args\":{\"detail\":\"");
+    p = trace_string(p, detail, TRACE_DETAIL);
+    p += sprintf(p, "\"}");
+  }
+  p += sprintf(p, "}");
+  tracelen = p - tracebuf;
+}
+
+static char *trace_string(char *p, const char *str, int max) {
+  // JSON escaped, and cut short since it only has to identify the event
+  for (int i = 0; str[i] != 0 && i < max; i++) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (c < 0x20) {
+      p += sprintf(p, "\\u%04x", c);
+    } else {
+      *p++ = c;
+    }
+  }
+  return p;
+}
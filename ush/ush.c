@@ -4,36 +4,41 @@
  * Spring Quarter 2020
  */
 
+#define _GNU_SOURCE
+
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include "defn.h"
 
-// Constants
-#define LINELEN 200000
-
 // Prototypes
-int remove_comments(char *buffer);
-char ** arg_parse(char *line, int *argcptr);
-int check_for_pipelines(char *line);
-int process_pipelines(char *line, int pl_infd, int pl_outfd, int wait);
-void kill_zombies(void);
-int check_for_quotes(const char *line, int *ptr);
-void strip_quotes(char *arg);
+int capture_pipeline(struct pipeline *pl, int infd, int flags);
+int run_command(char **argpointers, int argc, int fds[3], pid_t pgid,
+                int flags);
+int open_redirects(struct redirect *redir, int fds[3], int *opened);
+int process_pipelines(struct pipeline *pl, int pl_infd, int pl_outfd, int job,
+                      int flags);
 void catch_signal(int signal);
 
 // Shell main
 int main(int argc, char **argv) {
-  FILE *inputfile;
-  int interactive; // "Boolean" representing if the shell is in interactive mode
-  char buffer[LINELEN];
-  int len;
+  int inputfd;
+  struct reader input;
+  struct script_cache cache;
+  int cached; // "Boolean" representing if the script runs from its cache
+  struct lineir ir;
+  char *buffer;
+  size_t len;
   // Initialize global references to argc and argv
   mainargc = argc;
   mainargv = argv;
@@ -44,328 +49,482 @@ int main(int argc, char **argv) {
   if (sigaction(SIGINT, &sa, NULL)) {
     perror("sigaction");
   }
+  // Start tracing if USH_TRACE asks for it
+  trace_open();
+  // Let builtins hold back their output if nobody is watching it
+  builtin_hold_init();
   if (argc > 1) {
     // Attempt to open inputted script file
-    inputfile = fopen(mainargv[1], "r");
+    inputfd = open(mainargv[1], O_RDONLY | O_CLOEXEC);
     interactive = 0;
   } else {
     // Just take standard input
-    inputfile = stdin;
+    inputfd = 0;
     interactive = 1;
   }
-  if (inputfile == NULL) {
-    perror("fopen");
+  if (inputfd < 0) {
+    perror("open");
+    return 127;
+  }
+  // Scripts may come precompiled, everything else is read line by line
+  cached = argc > 1 && script_cache_open(&cache, mainargv[1], inputfd);
+  if (!cached && !reader_open(&input, inputfd)) {
     return 127;
   }
   while (1) {
     // Reset sigint global
     sigint_caught = 0;
+    // Collect background jobs that have finished since the last line
+    job_reap();
     // Prompt and get line
     if (interactive) {
+      builtin_flush();
+      job_print(2, 1);
       fprintf (stderr, "%% ");
     }
-    if (fgets (buffer, LINELEN, inputfile) != buffer) {
-      break;
-    }
-    // Get rid of \n at end of buffer
-    if (!remove_comments(buffer)) {
-      len = strlen(buffer);
-      if (buffer[len-1] == '\n') {
-        buffer[len-1] = 0;
+    if (cached) {
+      // Already compiled, skip straight to running it
+      if (!script_cache_next(&cache, &buffer, &ir)) {
+        break;
       }
+      if (!(ir.flags & LEX_EMPTY)) {
+        execute_line(buffer, &ir, 0, 1, WAIT | EXPAND);
+      }
+      arena_reset();
+      continue;
+    }
+    // Lines come back without their \n
+    if ((buffer = reader_next(&input, &len)) == NULL) {
+      break;
     }
     // Run it...
     processline (buffer, 0, 1, WAIT | EXPAND);
+    // Everything the line allocated goes away at once
+    arena_reset();
   }
-  if (!feof(inputfile)) {
-    perror ("read");
+  if (cached) {
+    script_cache_close(&cache);
+  } else {
+    reader_close(&input);
   }
+  builtin_flush();
   // Also known as exit(0)
   return 0;
 }
 
-int remove_comments(char *buffer) {
-  for (int i = 0; buffer[i] != 0; i++) {
-    // If comment is found, remove it
-    if (buffer[i] == '#' && buffer[i - 1] != '$') {
-      buffer[i] = 0;
-      return 1;
-    }
+/*
+ * Run one line. Without WAIT in flags, the return value is 0 or the job
+ * started for the line + 1, which the caller must job_wait() and job_free().
+ */
+int processline(char *line, int infd, int outfd, int flags) {
+  struct lineir ir;
+  // Strip comments and find what expand() will have to look at
+  TRACE_BEGIN("lex_compile", NULL);
+  int compiled = lex_compile(line, &ir);
+  TRACE_END("lex_compile");
+  if (!compiled) {
+    return -1;
   }
-  return 0;
+  return execute_line(line, &ir, infd, outfd, flags);
 }
 
-int processline(char *line, int infd, int outfd, int flags) {
-  int argc;
-  char **argpointers;
+int execute_line(char *line, struct lineir *ir, int infd, int outfd,
+                 int flags) {
   char *line_to_use; // The final line to use for argument parsing
-  pid_t cpid = 0;
-  // Attempt to expand if flags say to do so
-  if (flags & EXPAND) {
-    char expanded_line[LINELEN];
-    if (!expand(line, expanded_line, LINELEN)) {
+  struct buffer expanded_line;
+  struct pipeline pl;
+  int result;
+  TRACE_BEGIN("line", line);
+  // Lines without expansion sites may already be split
+  if (ir->pl != NULL) {
+    result = run_pipeline(ir->pl, infd, outfd, flags);
+    TRACE_END("line");
+    return result;
+  }
+  // Only expand if flags say to and there is anything to
+  line_to_use = line;
+  if ((flags & EXPAND) && (ir->flags & LEX_EXPAND)) {
+    TRACE_BEGIN("expand", NULL);
+    result = expand(line, ir, &expanded_line);
+    TRACE_END("expand");
+    if (!result) {
+      TRACE_END("line");
       return -1;
     }
-    line_to_use = expanded_line;
-    // Check for any pipelines
-    if (check_for_pipelines(line_to_use)) {
-      if (process_pipelines(line_to_use, infd, outfd, flags & WAIT)) {
-        return -1;
-      } else {
-        kill_zombies();
-        return 0;
-      }
+    line_to_use = expanded_line.data;
+  }
+  // Split line into pipeline stages and arguments in a single pass
+  TRACE_BEGIN("lex_split", NULL);
+  result = lex_split(line_to_use, &pl);
+  TRACE_END("lex_split");
+  if (!result) {
+    TRACE_END("line");
+    return 0;
+  }
+  result = run_pipeline(&pl, infd, outfd, flags);
+  TRACE_END("line");
+  return result;
+}
+
+int run_pipeline(struct pipeline *pl, int infd, int outfd, int flags) {
+  struct timespec started;
+  int status;
+  // Output for a $(...) goes wherever capture_pipeline() decides
+  if (flags & CAPTURE) {
+    return capture_pipeline(pl, infd, flags & ~CAPTURE);
+  }
+  // A leading time keyword reports what the whole pipeline cost
+  int timed = time_keyword(pl);
+  if (timed < 0) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  int job = job_start(pl);
+  if (job < 0) {
+    return -1;
+  }
+  if (pl->background) {
+    // Nothing waits on a background job, and it mustn't read the terminal
+    flags &= ~WAIT;
+    if (infd == 0 && (infd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+      perror("open");
+      job_free(job);
+      return -1;
     }
-  } else {
-    // Otherwise, just parse the original line
-    line_to_use = line;
   }
-  // Split line by arguments
-  argpointers = arg_parse(line_to_use, &argc);
+  int error = process_pipelines(pl, infd, outfd, job, flags);
+  if (pl->background && infd != 0 && close(infd)) {
+    perror("close");
+  }
+  if (job_count(job) == 0) {
+    // Only builtins ran, they already set last_exit
+    if (timed) {
+      time_report(pl, job, &started, timed, 2);
+    }
+    job_free(job);
+    return error;
+  }
+  if (pl->background && !error) {
+    if (interactive) {
+      fprintf(stderr, "[%d] %d\n", job_id(job), job_last_pid(job));
+    }
+    last_exit = 0;
+    return 0;
+  }
+  if (!(flags & WAIT) && !error) {
+    // The caller waits on the job itself
+    return job + 1;
+  }
+  // Wait on every stage, the last one decides the exit value
+  TRACE_BEGIN("wait", NULL);
+  if (job_wait(job, &status) > 0) {
+    last_exit = report_status(status, outfd);
+  }
+  TRACE_END("wait");
+  if (timed) {
+    time_report(pl, job, &started, timed, 2);
+  }
+  job_free(job);
+  return error;
+}
+
+/*
+ * Run a pipeline for a $(...). A lone builtin that can writes its output
+ * straight into the capture buffer, with no pipe and no fork. Anything else
+ * runs as usual into a pipe, whose read end is left in capture->fd.
+ */
+int capture_pipeline(struct pipeline *pl, int infd, int flags) {
+  struct builtin *builtin = NULL;
+  int pipefd[2];
+  if (pl->nstages == 1 && !pl->background && pl->stages[0].argc > 0 &&
+      pl->stages[0].redirs == NULL) {
+    builtin = command_builtin(pl->stages[0].argv, pl->stages[0].argc);
+  }
+  if (builtin != NULL && (builtin->flags & BUILTIN_CAPTURE)) {
+    TRACE_BEGIN("builtin", pl->stages[0].argv[0]);
+    builtin_capture = capture;
+    run_builtin(builtin, pl->stages[0].argv, pl->stages[0].argc, infd, -1);
+    builtin_capture = NULL;
+    TRACE_END("builtin");
+    return 0;
+  }
+  // Close on exec, so a background job started later can't hold it open
+  if (pipe2(pipefd, O_CLOEXEC)) {
+    perror("pipe");
+    return -1;
+  }
+  // Nothing reads it until this returns, so even the last stage is PIPED
+  int result = run_pipeline(pl, infd, pipefd[1], flags | PIPED);
+  // Only the children write to it from here on
+  if (close(pipefd[1])) {
+    perror("close");
+  }
+  if (result < 0) {
+    if (close(pipefd[0])) {
+      perror("close");
+    }
+    return result;
+  }
+  capture->fd = pipefd[0];
+  return result;
+}
+
+/*
+ * Run one stage with fds as its stdin, stdout and stderr. A program is
+ * spawned. A builtin follows one rule, whatever its position: if its output
+ * goes to a pipe that nothing may be reading yet (PIPED, every stage but the
+ * last, and the last inside a $(...)), it must not run in the shell, which
+ * would block once the pipe is full. So a BUILTIN_OUTPUT one (echo, printf,
+ * pwd, cat, ...) is forked with spawn_builtin(), and any other, which may
+ * change the shell, runs in it, printing into a memfd that a forked cat
+ * streams on, unless it is BUILTIN_PIPESAFE and prints a line at most.
+ * Anywhere else a builtin runs in the shell and writes straight to its
+ * stdout, a BUILTIN_BUFFERED one through the hold that builtin_flush()
+ * empties before anything else writes there.
+ *
+ * Returns the pid of the process to wait for, 0 if there is none, or -1.
+ */
+int run_command(char **argpointers, int argc, int fds[3], pid_t pgid,
+                int flags) {
+  int infd = fds[0];
+  int outfd = fds[1];
+  pid_t cpid = 0;
+  struct builtin *builtin;
   // Only proceed if any arguments were found
   if (argc > 0) {
-    // No need to fork if the command is a shell builtin
-    if (!check_for_builtin(argpointers, argc, outfd)) {
-      // Attempt to fork the process
-      cpid = fork();
-      if (cpid < 0) {
-        perror("fork");
-        return -1;
+    // Builtins go by the rule above
+    builtin = command_builtin(argpointers, argc);
+    if (builtin != NULL && (flags & PIPED) &&
+        (builtin->flags & BUILTIN_OUTPUT)) {
+      TRACE_BEGIN("spawn", argpointers[0]);
+      cpid = spawn_builtin(builtin, argpointers, argc, fds, pgid);
+      TRACE_END("spawn");
+    } else if (builtin != NULL) {
+      int held = -1;
+      if ((flags & PIPED) && !(builtin->flags & BUILTIN_PIPESAFE)) {
+        if ((held = memfd_create("builtin", MFD_CLOEXEC)) < 0) {
+          perror("memfd_create");
+        } else {
+          outfd = held;
+        }
       }
-      // Check if this process is the new child process
-      if (cpid == 0) {
-        // Replace stdin with infd and then close infd
-        if (infd != 0) {
-          if (dup2(infd, 0) < 0) {
-            perror("dup2");
-            return -1;
-          }
-          if (close(infd) < 0) {
-            perror("close");
-            return -1;
-          }
+      // Builtins report errors on the shell's own stderr, point it there
+      int saved = -1;
+      if (fds[2] != 2) {
+        fflush(stderr);
+        if ((saved = fcntl(2, F_DUPFD_CLOEXEC, 3)) < 0 || dup2(fds[2], 2) < 0) {
+          perror("dup2");
+        }
+        // Output sent to the old stderr (>&2) still goes there
+        if (saved >= 0 && outfd == 2) {
+          outfd = saved;
         }
-        // Replace stdout with outfd and then close outfd
-        if (outfd != 1) {
-          if (dup2(outfd, 1) < 0) {
-            perror("dup2");
-            return -1;
-          }
-          if (close(outfd) < 0) {
-            perror("close");
-            return -1;
-          }
+        if (saved >= 0 && infd == 2) {
+          infd = saved;
         }
-        // Attempt to execute the command
-        execvp(argpointers[0], argpointers);
-        // If this line is reached, there must have been an error
-        perror("exec");
-        fclose(stdin);
-        exit(127);
       }
-      // Wait on the child process if the flags say to do so
-      if (flags & WAIT) {
+      TRACE_BEGIN("builtin", argpointers[0]);
+      run_builtin(builtin, argpointers, argc, infd, outfd);
+      TRACE_END("builtin");
+      if (saved >= 0) {
+        fflush(stderr);
+        dup2(saved, 2);
+        close(saved);
+      }
+      if (held >= 0) {
+        char *catargv[] = {"cat", NULL};
+        int catfds[3] = {held, fds[1], fds[2]};
+        lseek(held, 0, SEEK_SET);
+        cpid = spawn_builtin(find_builtin("cat"), catargv, 1, catfds, pgid);
+        close(held);
+      }
+    } else {
+      // Hold off SIGINT until waiting_on is set, the child may raise it early
+      sigset_t mask, oldmask;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGINT);
+      sigprocmask(SIG_BLOCK, &mask, &oldmask);
+      // Attempt to launch the command
+      TRACE_BEGIN("spawn", argpointers[0]);
+      cpid = spawn_command(argpointers, infd, outfd, fds[2], pgid);
+      TRACE_END("spawn");
+      if (cpid > 0 && (flags & WAIT)) {
         waiting_on = cpid;
-        int status;
-        if (wait(&status) < 0) {
-          perror("wait");
-          return -1;
-        } else {
-          waiting_on = 0;
-          // Update last exit global value
-          if (WIFEXITED(status)) {
-            last_exit = WEXITSTATUS(status);
-          }
-          if (WIFSIGNALED(status)) {
-            // Print signal description
-            if (WTERMSIG(status) != SIGINT) {
-              dprintf(outfd, "%s", strsignal(WTERMSIG(status)));
-              #ifdef WCOREDUMP
-              if (WCOREDUMP(status)) {
-                dprintf(outfd, " (core dumped)");
-              }
-              #endif
-              dprintf(outfd, "\n");
-            }
-            last_exit = 128 + WTERMSIG(status);
-          }
-        }
-      } else {
-        return cpid;
       }
+      sigprocmask(SIG_SETMASK, &oldmask, NULL);
     }
   }
-  free(argpointers);
-  return 0;
+  return cpid;
 }
 
-int check_for_pipelines(char *line) {
-  if (strchr(line, '|') == NULL) {
-    return 0;
-  } else {
-    return 1;
-  }
-}
-
-int process_pipelines(char *line, int pl_infd, int pl_outfd, int wait) {
-  // Initialize pointers for first command
-  char *pos_begin = line;
-  char *pos_end = &line[-1];
+int process_pipelines(struct pipeline *pl, int pl_infd, int pl_outfd, int job,
+                      int flags) {
   int pipefd[2];
   int infd = pl_infd;
   int outfd;
+  int error = 0;
+  int *fan = NULL; // Read ends of the pipes a fan-out pump feeds
+  int nfan = 0;
+  int fanused = 0;
+  TRACE_BEGIN("pipeline", NULL);
   // Loop through commands
-  while (1) {
-    // Find next command
-    pos_begin = &pos_end[1];
-    pos_end = strchr(pos_begin, '|');
-    if (pos_end == NULL) {
-      // If next command is the last one, force outfd to be stdout
+  for (int i = 0; i < pl->nstages; i++) {
+    struct stage *stage = &pl->stages[i];
+    int last = i == pl->nstages - 1;
+    // All but the last of a run of |+ write where the pipeline does
+    int piped = !last && !(stage->fanout && pl->stages[i + 1].fanout);
+    if (stage->fanout && !pl->stages[i - 1].fanout &&
+        !last && pl->stages[i + 1].fanout) {
+      // First of a run, start the pump copying the stage before to each
+      int count = 1;
+      while (i + count < pl->nstages && pl->stages[i + count].fanout) {
+        count++;
+      }
+      int *readfds = arena_alloc(sizeof(int) * count);
+      pid_t cpid = -1;
+      if (readfds == NULL) {
+        fprintf(stderr, "Allocation of fan-out failed.\n");
+      } else {
+        cpid = fanout(infd, readfds, count, job_pgid(job));
+      }
+      if (cpid < 0) {
+        error = -1;
+        break;
+      }
+      job_add(job, cpid, -1);
+      if (close(infd) < 0) {
+        perror("close");
+      }
+      fan = readfds;
+      nfan = count;
+      fanused = 0;
+    }
+    if (stage->fanout && fanused < nfan) {
+      infd = fan[fanused++];
+    }
+    if (!piped) {
+      // The last command, and the others sharing a |+, write to stdout
       outfd = pl_outfd;
     } else {
-      *pos_end = 0;
-      // Create new pipe
-      if (pipe(pipefd)) {
+      // Create new pipe, a writer holding its own read end never sees EPIPE
+      if (pipe2(pipefd, O_CLOEXEC)) {
         perror("pipe");
-        return -1;
+        error = -1;
+        break;
       }
       outfd = pipefd[1];
     }
-    // Process command
-    if (outfd == pl_outfd) {
-      // Use parent processline's wait flag to determine final wait flag
-      if (processline(pos_begin, infd, outfd, wait | NOEXPAND) < 0) {
-        if (close(infd) < 0) {
-          perror("close");
-        }
-        return -1;
+    // Files named by redirections replace the pipes and the shell's own
+    int fds[3] = {infd, outfd, 2};
+    int nopened = 0;
+    int *opened = NULL;
+    pid_t cpid = 0;
+    if (stage->redirs != NULL) {
+      int count = 0;
+      for (struct redirect *r = stage->redirs; r != NULL; r = r->next) {
+        count++;
+      }
+      opened = arena_alloc(sizeof(int) * count);
+      if (opened == NULL) {
+        fprintf(stderr, "Allocation of redirections failed.\n");
+        error = -1;
       } else {
-        if (close(infd) < 0) {
-          perror("close");
-          return -1;
-        }
-        return 0;
+        nopened = open_redirects(stage->redirs, fds, opened);
       }
-    } else if (processline(pos_begin, infd, outfd, NOWAIT | NOEXPAND) < 0) {
-      return -1;
     }
-    // Close infd if it isn't the first iteration
-    if (infd != pl_infd) {
-        if (close(infd) < 0) {
-          perror("close");
-          return -1;
-        }
+    // Process command, only the last one can be waited on in the foreground
+    if (nopened < 0) {
+      // The command doesn't run, but the rest of the pipeline still does
+      last_exit = 1;
+    } else if (!error) {
+      cpid = run_command(stage->argv, stage->argc, fds, job_pgid(job),
+                         last ? flags : NOWAIT | PIPED);
+    }
+    if (cpid < 0) {
+      error = -1;
+    } else if (cpid > 0) {
+      job_add(job, cpid, i);
     }
-    // Close outfd
-    if (close(outfd) < 0) {
+    // The command has its own copies now
+    for (int k = 0; k < nopened; k++) {
+      close(opened[k]);
+    }
+    // Close infd if it isn't the first iteration
+    if (infd != pl_infd && close(infd) < 0) {
       perror("close");
-      return -1;
+      error = -1;
     }
-    // Update infd
-    infd = pipefd[0];
-  }
-}
-
-void kill_zombies(void) {
-    while (waitpid(-1, NULL, WNOHANG) > -1);
-}
-
-char ** arg_parse(char *line, int *argcptr) {
-  int argc = 0;
-  int ptr = 0; // "Pointer" for current position in line
-  // Count arguments to determine value of argc
-  while (line[ptr] != 0) {
-    if (line[ptr] == ' ') {
-      // Skip leading/trailing spaces
-      ptr++;
-    } else {
-      // Argument found
-      argc++;
-      // Find end of argument
-      while (line[ptr] != ' ' && line[ptr] != 0) {
-        if (!check_for_quotes(line, &ptr)) {
-          *argcptr = 0;
-          return NULL;
-        }
-        ptr++;
+    infd = pl_infd;
+    if (piped) {
+      // Close outfd and update infd
+      if (close(outfd) < 0) {
+        perror("close");
+        error = -1;
       }
+      infd = pipefd[0];
     }
-  }
-  // Return if no arguments were found
-  if (argc < 1) {
-    *argcptr = 0;
-    return NULL;
-  }
-  // Attempt to malloc for argpointers array
-  char ** argpointers = malloc(sizeof(char *) * (argc + 1));
-  if (argpointers == NULL) {
-    fprintf(stderr, "Malloc of argument pointer array failed.\n");
-    *argcptr = 0;
-    return NULL;
-  }
-  // Initialize indexing integers
-  ptr = 0;
-  int index = 0; // Current index of argpointers
-  // Populate argpointers
-  while (line[ptr] != 0 && index < argc) {
-    if (line[ptr] == ' ') {
-      // Skip leading/trailing spaces
-      ptr++;
-    } else {
-      // Argument found
-      argpointers[index] = &line[ptr];
-      index++;
-      // Find end of argument and replace trailing space with 0
-      while (line[ptr] != ' ' && line[ptr] != 0) {
-        if (!check_for_quotes(line, &ptr)) {
-          *argcptr = 0;
-          return NULL;
-        }
-        ptr++;
-      }
-      line[ptr] = 0;
-      ptr++;
+    if (error) {
+      break;
     }
   }
-  // Set last element to NULL for execvp
-  argpointers[argc] = NULL;
-  // Remove quotes from all arguments
-  for (index = 0; index < argc; index++) {
-    strip_quotes(argpointers[index]);
+  // A stage that failed leaves the next one's input open
+  if (infd != pl_infd && close(infd) < 0) {
+    perror("close");
   }
-  // Set argc upstream
-  *argcptr = argc;
-  return argpointers;
+  while (fanused < nfan) {
+    close(fan[fanused++]);
+  }
+  TRACE_END("pipeline");
+  return error;
 }
 
-int check_for_quotes(const char *line, int *ptr) {
-  if (line[*ptr] == '"') {
-    // If quote is found, find its partner
-    int tmp_ptr = *ptr;
-    tmp_ptr++;
-    while (line[tmp_ptr] != '"' && line[tmp_ptr] != 0) {
-      tmp_ptr++;
+/*
+ * Apply the redirections in redir to fds, the stdin, stdout and stderr a
+ * command is about to get, opening files with O_CLOEXEC as it goes. Every
+ * fd opened is put in opened. Returns how many there are, or -1 if one
+ * couldn't be opened (after saying why, and closing the others).
+ */
+int open_redirects(struct redirect *redir, int fds[3], int *opened) {
+  int nopened = 0;
+  for (; redir != NULL; redir = redir->next) {
+    int fd;
+    if (redir->type == REDIR_DUP) {
+      fds[redir->fd] = fds[redir->dupfd];
+      continue;
     }
-    // Print error and return if EOS is reached before another quote is found
-    if (line[tmp_ptr] == 0) {
-      fprintf(stderr, "Odd number of quotes found in input.\n");
-      return 0;
+    if (redir->type == REDIR_IN) {
+      fd = open(redir->path, O_RDONLY | O_CLOEXEC);
+    } else if (redir->type == REDIR_APPEND) {
+      fd = open(redir->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    } else if (redir->type == REDIR_OUT && noclobber) {
+      // Only create it, unless what is there isn't a regular file
+      fd = open(redir->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+      struct stat buf;
+      if (fd < 0 && errno == EEXIST && !stat(redir->path, &buf)) {
+        if (S_ISREG(buf.st_mode)) {
+          fprintf(stderr, "%s: cannot overwrite existing file\n",
+                  redir->path);
+          fd = -2;
+        } else {
+          fd = open(redir->path, O_WRONLY | O_CLOEXEC);
+        }
+      }
+    } else {
+      fd = open(redir->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
     }
-    *ptr = tmp_ptr;
-  }
-  return 1;
-}
-
-void strip_quotes(char *arg) {
-  int i = 0; // Current index of arg
-  int offset = 0; // Current offset (number of quotes)
-  while (arg[i] != 0) {
-    while (arg[i + offset] == '"') {
-      offset++;
+    if (fd < 0) {
+      if (fd == -1) {
+        perror(redir->path);
+      }
+      while (nopened > 0) {
+        close(opened[--nopened]);
+      }
+      return -1;
     }
-    arg[i] = arg[i + offset];
-    i++;
+    opened[nopened++] = fd;
+    fds[redir->fd] = fd;
   }
+  return nopened;
 }
 
 void catch_signal(int signal) {
@@ -0,0 +1,378 @@
+/*
+ * CSCI 347 Microshell
+ * Jamal Marri
+ * Spring Quarter 2020
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "defn.h"
+
+/*
+ * Recursive directory walker behind ** globs. Every directory is a task
+ * holding its path below the root, opened with openat() on the root's fd
+ * and read with getdents64() in large batches. Each worker thread keeps its
+ * own deque of tasks, taking new work from the back (depth first, while the
+ * parent is still in cache) and, when it runs dry, stealing from the front
+ * of someone else's (the oldest, biggest subtrees). Matches go into a
+ * buffer per worker and are joined at the end; the caller sorts them, so
+ * the result doesn't depend on which thread found what.
+ *
+ * Symlinks to directories are matched but never followed, and directories
+ * starting with '.' are never entered, like bash's globstar.
+ */
+
+// Constants
+#define DENTS_SIZE 65536
+#define MAX_WORKERS 8
+#define DEQUE_START 64
+#define NAMES_START 4096
+
+// Layout of what getdents64() returns
+struct dent64 {
+  ino_t d_ino;
+  off_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct walktask {
+  char *path; // Below the root, "" or ending with '/'
+  int depth;
+};
+
+// Owner works at the tail, thieves take from the head
+struct deque {
+  pthread_mutex_t lock;
+  struct walktask *tasks;
+  int head;
+  int tail;
+  int size;
+};
+
+struct worker {
+  struct walkshared *shared;
+  struct deque dq;
+  char *names; // Matches, each one 0 terminated
+  size_t len;
+  size_t size;
+  long count;
+  pthread_t thread;
+};
+
+struct walkshared {
+  struct treewalk *tw;
+  int rootfd;
+  struct worker *workers;
+  int nworkers;
+  atomic_long pending; // Tasks pushed and not yet finished
+  atomic_long matches;
+  atomic_int failed; // WALK_OK, WALK_ERROR or WALK_LIMIT
+};
+
+// Outcomes
+#define WALK_OK 0
+#define WALK_ERROR 1
+#define WALK_LIMIT 2
+
+// Prototypes
+static void *work(void *arg);
+static void read_dir(struct worker *w, struct walktask *task);
+static int push(struct deque *dq, char *path, int depth);
+static int pop(struct deque *dq, struct walktask *task);
+static int steal(struct deque *dq, struct walktask *task);
+static int emit(struct worker *w, const char *path, size_t pathlen,
+                const char *name, int slash);
+static void fail(struct walkshared *shared, int why);
+
+int tree_walk(struct treewalk *tw) {
+  struct walkshared shared;
+  int ok = 1;
+  tw->names = NULL;
+  tw->len = 0;
+  tw->count = 0;
+  shared.tw = tw;
+  shared.rootfd = open(tw->root[0] != 0 ? tw->root : ".",
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (shared.rootfd < 0) {
+    // Nothing there to match
+    return 1;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  shared.nworkers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+  shared.workers = calloc(shared.nworkers, sizeof(struct worker));
+  if (shared.workers == NULL) {
+    fprintf(stderr, "Malloc of glob workers failed.\n");
+    close(shared.rootfd);
+    return 0;
+  }
+  atomic_init(&shared.pending, 0);
+  atomic_init(&shared.matches, 0);
+  atomic_init(&shared.failed, WALK_OK);
+  for (int k = 0; k < shared.nworkers; k++) {
+    shared.workers[k].shared = &shared;
+    pthread_mutex_init(&shared.workers[k].dq.lock, NULL);
+  }
+  // Read the root here, small trees are done before a thread would start
+  struct worker *self = &shared.workers[0];
+  struct walktask root = {strdup(""), 0};
+  if (root.path == NULL) {
+    fail(&shared, WALK_ERROR);
+  } else {
+    read_dir(self, &root);
+  }
+  int started = 1;
+  if (atomic_load(&shared.pending) > 1) {
+    for (; started < shared.nworkers; started++) {
+      if (pthread_create(&shared.workers[started].thread, NULL, work,
+                         &shared.workers[started])) {
+        break;
+      }
+    }
+  }
+  work(self);
+  for (int k = 1; k < started; k++) {
+    pthread_join(shared.workers[k].thread, NULL);
+  }
+  // Join every worker's matches into one block
+  int failed = atomic_load(&shared.failed);
+  size_t total = 0;
+  for (int k = 0; k < shared.nworkers; k++) {
+    total += shared.workers[k].len;
+  }
+  if (failed == WALK_OK && total > 0) {
+    tw->names = malloc(total);
+    if (tw->names == NULL) {
+      failed = WALK_ERROR;
+    }
+  }
+  for (int k = 0; k < shared.nworkers; k++) {
+    struct worker *w = &shared.workers[k];
+    if (failed == WALK_OK && w->len > 0) {
+      memcpy(&tw->names[tw->len], w->names, w->len);
+      tw->len += w->len;
+      tw->count += w->count;
+    }
+    // Tasks are only left over if the walk was cut short
+    for (int t = w->dq.head; t < w->dq.tail; t++) {
+      free(w->dq.tasks[t].path);
+    }
+    free(w->dq.tasks);
+    free(w->names);
+    pthread_mutex_destroy(&w->dq.lock);
+  }
+  free(shared.workers);
+  close(shared.rootfd);
+  if (failed == WALK_LIMIT) {
+    fprintf(stderr, "glob: more than %ld matches, see USH_GLOB_MAX\n",
+            tw->max_matches);
+    ok = 0;
+  } else if (failed == WALK_ERROR) {
+    fprintf(stderr, "Malloc of glob matches failed.\n");
+    ok = 0;
+  }
+  if (!ok) {
+    free(tw->names);
+    tw->names = NULL;
+    tw->len = 0;
+    tw->count = 0;
+  }
+  return ok;
+}
+
+static void *work(void *arg) {
+  struct worker *w = arg;
+  struct walkshared *shared = w->shared;
+  struct walktask task;
+  int next = 0; // Where to start looking for work to steal
+  while (atomic_load(&shared->failed) == WALK_OK) {
+    int found = pop(&w->dq, &task);
+    for (int k = 0; !found && k < shared->nworkers; k++) {
+      struct worker *victim = &shared->workers[(next + k) % shared->nworkers];
+      if (victim != w && steal(&victim->dq, &task)) {
+        found = 1;
+        next = (next + k) % shared->nworkers;
+      }
+    }
+    if (found) {
+      read_dir(w, &task);
+      continue;
+    }
+    // Nothing anywhere, done once nobody can make more
+    if (atomic_load(&shared->pending) == 0) {
+      break;
+    }
+    sched_yield();
+  }
+  return NULL;
+}
+
+static void read_dir(struct worker *w, struct walktask *task) {
+  struct walkshared *shared = w->shared;
+  struct treewalk *tw = shared->tw;
+  char dents[DENTS_SIZE];
+  size_t pathlen = strlen(task->path);
+  int fd = openat(shared->rootfd, pathlen > 0 ? task->path : ".",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  long chars;
+  while (fd >= 0 && atomic_load(&shared->failed) == WALK_OK &&
+         (chars = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+    for (long pos = 0; pos < chars;) {
+      struct dent64 *entry = (struct dent64 *) &dents[pos];
+      char *name = entry->d_name;
+      pos += entry->d_reclen;
+      if (name[0] == '.' && (name[1] == 0 ||
+                             (name[1] == '.' && name[2] == 0))) {
+        continue;
+      }
+      int dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        // The file system didn't say, links still don't count
+        struct stat buf;
+        dir = !fstatat(fd, name, &buf, AT_SYMLINK_NOFOLLOW) &&
+              S_ISDIR(buf.st_mode);
+      }
+      if ((name[0] != '.' || tw->hidden) && (dir || !tw->dirs_only) &&
+          (tw->match == NULL || tw->match(tw->arg, name)) &&
+          !emit(w, task->path, pathlen, name, tw->dirs_only)) {
+        break;
+      }
+      if (dir && name[0] != '.' && task->depth < tw->max_depth) {
+        // Its path is this one's plus its name
+        size_t namelen = strlen(name);
+        char *path = malloc(pathlen + namelen + 2);
+        if (path == NULL) {
+          fail(shared, WALK_ERROR);
+          break;
+        }
+        memcpy(path, task->path, pathlen);
+        memcpy(&path[pathlen], name, namelen);
+        strcpy(&path[pathlen + namelen], "/");
+        atomic_fetch_add(&shared->pending, 1);
+        if (!push(&w->dq, path, task->depth + 1)) {
+          atomic_fetch_sub(&shared->pending, 1);
+          free(path);
+          fail(shared, WALK_ERROR);
+          break;
+        }
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(task->path);
+  // The root task was never counted
+  if (task->depth > 0) {
+    atomic_fetch_sub(&shared->pending, 1);
+  }
+}
+
+static int push(struct deque *dq, char *path, int depth) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->size) {
+    // Slide down over what has been stolen, or grow
+    int live = dq->tail - dq->head;
+    if (dq->head > 0 && live < dq->size / 2) {
+      memmove(dq->tasks, &dq->tasks[dq->head],
+              sizeof(struct walktask) * live);
+    } else {
+      int size = dq->size ? dq->size * 2 : DEQUE_START;
+      struct walktask *tasks = realloc(dq->tasks,
+                                       sizeof(struct walktask) * size);
+      if (tasks == NULL) {
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+      }
+      dq->tasks = tasks;
+      dq->size = size;
+      memmove(dq->tasks, &dq->tasks[dq->head],
+              sizeof(struct walktask) * live);
+    }
+    dq->head = 0;
+    dq->tail = live;
+  }
+  dq->tasks[dq->tail].path = path;
+  dq->tasks[dq->tail].depth = depth;
+  dq->tail++;
+  pthread_mutex_unlock(&dq->lock);
+  return 1;
+}
+
+static int pop(struct deque *dq, struct walktask *task) {
+  int found = 0;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail > dq->head) {
+    *task = dq->tasks[--dq->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+static int steal(struct deque *dq, struct walktask *task) {
+  int found = 0;
+  // Don't wait behind the owner, there are other places to look
+  if (pthread_mutex_trylock(&dq->lock)) {
+    return 0;
+  }
+  if (dq->tail > dq->head) {
+    *task = dq->tasks[dq->head++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+static int emit(struct worker *w, const char *path, size_t pathlen,
+                const char *name, int slash) {
+  struct walkshared *shared = w->shared;
+  if (atomic_fetch_add(&shared->matches, 1) >= shared->tw->max_matches) {
+    fail(shared, WALK_LIMIT);
+    return 0;
+  }
+  size_t namelen = strlen(name);
+  size_t need = pathlen + namelen + slash + 1;
+  if (w->len + need > w->size) {
+    size_t size = w->size ? w->size * 2 : NAMES_START;
+    while (size < w->len + need) {
+      size *= 2;
+    }
+    char *names = realloc(w->names, size);
+    if (names == NULL) {
+      fail(shared, WALK_ERROR);
+      return 0;
+    }
+    w->names = names;
+    w->size = size;
+  }
+  char *p = &w->names[w->len];
+  memcpy(p, path, pathlen);
+  memcpy(&p[pathlen], name, namelen);
+  if (slash) {
+    p[pathlen + namelen] = '/';
+  }
+  p[pathlen + namelen + slash] = 0;
+  w->len += need;
+  w->count++;
+  return 1;
+}
+
+static void fail(struct walkshared *shared, int why) {
+  int expected = WALK_OK;
+  atomic_compare_exchange_strong(&shared->failed, &expected, why);
+}